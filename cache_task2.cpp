@@ -35,6 +35,28 @@
 #include <iomanip>
 #include <string.h>
 #include <fstream> 
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cmath>
+#include <list>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <memory>
 #include "aca2009.h"
 
 using namespace std;
@@ -53,1024 +75,5902 @@ class Bus_if : public virtual sc_interface
 		virtual bool read(int writer, int address) = 0;
 		virtual bool write(int writer, int address, int data) = 0;
 		virtual bool writex(int writer, int address, int data) = 0;
+		// write update, returns whether another cache still holds the line
+		virtual bool update(int writer, int address, int data) = 0;
+		// snoopers holding the line of the current transaction pull the shared line
+		virtual void assert_shared() = 0;
+		// hold the bus across the transactions of an atomic read-modify-write
+		virtual void lock(int writer) = 0;
+		virtual void unlock(int writer) = 0;
+		// notified in the delta the signals of each transaction are driven
+		virtual const sc_event &request_event() const = 0;
 };
 
 typedef	struct 
 {
 	bool valid;
-	sc_uint<20> tag;
+	bool snooped; //invalidated by another cache's write, tag kept
+	bool shared; //another cache may hold the line (update protocols)
+	unsigned char sector_valid; //bit per sector of --sector words
+	unsigned char sector_dirty; //sectors not written through to memory yet
+	bool prefetched; //brought in by the prefetcher, not used by the CPU yet
+	sc_uint<27> tag; //address above the line offset and the index bits of the cache
 	//sc_int<8> data[32]; //32 byte line size 
 	int data[8]; //8 words = 32 byte line size 
 } aca_cache_line;
 
-typedef	struct 
+/* Entry of the fully-associative victim cache, keeps the index of the line */
+typedef	struct
 {
-	aca_cache_line cache_line[CACHE_LINES];
-} aca_cache_set; 
+	aca_cache_line line;
+	unsigned int line_index;
+	unsigned long last_use; //LRU stamp
+} aca_victim_line;
 
-typedef	struct
+/*
+ * Tree pseudo-LRU over the ways (CACHE_SETS by default, a power of two up
+ * to 16) of one line index. Node n of the tree (root = 0, children of n
+ * are 2n+1 and 2n+2) lives in bit ways-2-n of the lru_table entry. A set
+ * bit means the left half was used last, so the victim is searched in the
+ * right half.
+ */
+static inline void lru_touch(unsigned short &bits, int set, int ways = CACHE_SETS)
 {
-	aca_cache_set cache_set[CACHE_SETS];
-} aca_cache;
+	int node = 0;
+	for (int half = ways/2; half >= 1; half /= 2)
+	{
+		if (set < half){
+			bits |= 1 << (ways-2-node);
+			node = 2*node+1;
+		}
+		else{
+			bits &= ~(1 << (ways-2-node));
+			set -= half;
+			node = 2*node+2;
+		}
+	}
+}
 
-SC_MODULE(Cache) 
+static inline int lru_victim(unsigned short bits, int ways = CACHE_SETS)
+{
+	int node = 0;
+	int set = 0;
+	for (int half = ways/2; half >= 1; half /= 2)
+	{
+		if (bits & (1 << (ways-2-node))){
+			set += half;
+			node = 2*node+2;
+		}
+		else
+			node = 2*node+1;
+	}
+	return set;
+}
+
+/* Run-time options, stripped from argv before init_tracefile() sees it */
+bool opt_parallel = false;	// --parallel: one host thread per CPU+Cache
+long opt_quantum  = 1000;	// --quantum=N: cycles between synchronizations
+int  opt_shards   = 0;		// --shards=N: untimed, line indices split over N threads
+
+#define TRACE_CLK 1
+#define TRACE_CPU 2
+#define TRACE_BUS 4
+int  opt_trace         = 0;		// --trace=clk,cpu,bus|all: waveform groups, none by default
+long opt_trace_start   = 0;		// --trace-start=N: first traced cycle
+long opt_trace_stop    = -1;		// --trace-stop=N: last traced cycle
+bool opt_trace_trigger = false;		// --trace-trigger=ADDR: start when ADDR is on the bus
+unsigned int opt_trace_addr = 0;
+bool opt_trace_gz      = false;		// --trace-gz: write CPU_MEM.vcd.gz
+const char *opt_trace_file = "CPU_MEM";	// --trace-file=NAME
+bool opt_bench = false;			// --bench: host side metrics to bench.txt
+bool opt_check = false;			// --check: lockstep golden model next to the caches, see Checker,
+					// or with --parallel / --shards a detailed run to compare with, see check_engine
+
+/* Coherence on a snooped write: invalidate the copies, or update them */
+enum Protocol
+{
+	PROTOCOL_INVALIDATE,
+	PROTOCOL_DRAGON,	// update, write back
+	PROTOCOL_FIREFLY	// update, shared lines written through
+};
+const char *protocol_names[] = { "invalidate", "dragon", "firefly" };
+int opt_protocol = PROTOCOL_INVALIDATE;	// --protocol=NAME
+int opt_sector = 8;			// --sector=N: words per sector, the fill and write through unit
+int opt_victim = 0;			// --victim=N: victim cache entries per cache, 0 for none
+
+/* How lines are spread over the memory channels, see MemorySystem */
+enum Interleave
+{
+	INTERLEAVE_LINE,
+	INTERLEAVE_PAGE,
+	INTERLEAVE_XOR
+};
+const char *interleave_names[] = { "line", "page", "xor" };
+int opt_channels = 0;			// --channels=N: memory channels, 0 for the flat latency
+int opt_interleave = INTERLEAVE_LINE;	// --interleave=line|page|xor
+int opt_channel_cycles = 100;		// --channel-cycles=C: cycles a channel is busy per word
+
+/* Virtual memory, see PageTable */
+enum PageAlloc
+{
+	PAGE_ALLOC_SEQUENTIAL,
+	PAGE_ALLOC_RANDOM,
+	PAGE_ALLOC_COLOR
+};
+const char *page_alloc_names[] = { "sequential", "random", "color" };
+int opt_tlb = 0;			// --tlb=N: TLB entries per CPU, 0 for no translation
+int opt_tlb_ways = 4;			// --tlb-ways=W
+unsigned long opt_page_size = 4096;	// --page-size=BYTES, k and m suffixes
+int opt_page_alloc = PAGE_ALLOC_SEQUENTIAL;	// --page-alloc=KIND
+int opt_page_colors = 8;		// --page-colors=N for --page-alloc=color
+
+long opt_interval = 0;			// --interval=N: sample every N cycles to intervals.txt, 0 for none
+int opt_phases = 4;			// --phases=K: clusters of the phase detection
+
+const char *opt_server = NULL;		// --server=SOCKET: run jobs sent to a Unix socket
+int opt_server_jobs = 4;		// --server-jobs=N: jobs running at once
+const char *opt_server_dir = "jobs";	// --server-dir=DIR: where the jobs write their reports
+
+/* Per-CPU cache configuration, see load_cache_config */
+enum Replacement
+{
+	REPLACE_PLRU,	// tree pseudo-LRU, the built-in policy
+	REPLACE_LRU,
+	REPLACE_FIFO,
+	REPLACE_RANDOM
+};
+const char *replacement_names[] = { "plru", "lru", "fifo", "random" };
+enum Prefetch
+{
+	PREFETCH_NONE,
+	PREFETCH_NEXT	// next line on a miss
+};
+const char *prefetch_names[] = { "none", "next" };
+struct CacheConfig
+{
+	unsigned long size;	// bytes, 32 byte lines
+	int ways;
+	int policy;		// enum Replacement
+	int hit_cycles;		// lookup latency, 1 for the built-in cache
+	int prefetch;		// enum Prefetch
+};
+struct CacheConfigRule
+{
+	unsigned int first, last;	// CPUs the line of the file applies to
+	CacheConfig config;
+};
+vector<CacheConfigRule> cache_config_rules;
+const char *opt_cache_config = NULL;	// --cache-config=FILE: per-CPU cache geometry, policy and prefetcher
+
+/* Synthetic workload instead of a tracefile, see SyntheticSource and LockSource */
+enum SynthKind
+{
+	SYNTH_NONE,
+	SYNTH_STRIDE,
+	SYNTH_RANDOM,
+	SYNTH_PRODCONS,
+	SYNTH_MIGRATORY,
+	SYNTH_FALSESHARE,
+	SYNTH_ZIPF,
+	SYNTH_SPINLOCK,
+	SYNTH_TICKET,
+	SYNTH_MCS
+};
+const char *synth_names[] = { "none", "stride", "random", "prodcons", "migratory", "falseshare", "zipf",
+	"spinlock", "ticket", "mcs" };
+int  opt_synth       = 0;		// --synth=KIND
+unsigned int opt_cpus = 4;		// --cpus=N
+long opt_accesses    = 100000;		// --accesses=N per CPU
+unsigned int opt_wss = 65536;		// --wss=BYTES
+unsigned long opt_seed = 1;		// --seed=S
+int  opt_write_ratio = 30;		// --write-ratio=PCT
+int  opt_nop_ratio   = 0;		// --nop=PCT
+unsigned int opt_stride = 32;		// --stride=BYTES
+double opt_zipf      = 0.99;		// --zipf=ALPHA
+
+static bool option_value(const char *arg, const char *name, const char **value)
+{
+	size_t len = strlen(name);
+	if (strncmp(arg, name, len) != 0 || arg[len] != '=')
+		return false;
+	*value = arg + len + 1;
+	return true;
+}
+
+// bytes, with an optional k or m suffix
+static unsigned long size_value(const char *value)
+{
+	char *end;
+	unsigned long size = strtoul(value, &end, 0);
+	if (*end == 'k' || *end == 'K')
+		size <<= 10;
+	else if (*end == 'm' || *end == 'M')
+		size <<= 20;
+	return size;
+}
+
+// index of value in names, -1 if it is none of them
+static int name_index(const char *value, const char **names, int count)
+{
+	for (int k = 0; k < count; k++)
+		if (strcmp(value, names[k]) == 0)
+			return k;
+	return -1;
+}
+
+/*
+ * Read the cache configurations of --cache-config. One line per CPU or
+ * range of CPUs, later lines override earlier ones, and CPUs no line
+ * names keep the built-in 32k 8-way PLRU cache:
+ *
+ *   # cpus  size  ways  policy  hit  prefetch
+ *   *       32k   8     plru    1    none
+ *   0-1     64k   8     lru     2    next
+ *   2-7     8k    2     fifo    1    none
+ *
+ * cpus is N, N-M or *; policy plru, lru, fifo or random; prefetch none or
+ * next. All caches keep 32 byte lines, so the coherence protocol works on
+ * the same unit whatever the size and associativity of each cache.
+ */
+static void load_cache_config(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+	{
+		cerr << "Cannot open cache configuration " << path << endl;
+		exit(1);
+	}
+
+	char line[256];
+	cache_config_rules.clear();
+	for (int n = 1; fgets(line, sizeof(line), f) != NULL; n++)
+	{
+		char cpus[32], size[32], policy[32], prefetch[32];
+		CacheConfigRule rule;
+		char *comment = strchr(line, '#');
+
+		if (comment)
+			*comment = '\0';
+		if (sscanf(line, "%31s", cpus) != 1)
+			continue;
+		const char *error = NULL;
+		if (sscanf(line, "%31s %31s %d %31s %d %31s", cpus, size, &rule.config.ways, policy,
+			&rule.config.hit_cycles, prefetch) != 6)
+			error = "expected cpus size ways policy hit prefetch";
+		else
+		{
+			rule.config.size = size_value(size);
+			rule.config.policy = name_index(policy, replacement_names, sizeof(replacement_names) / sizeof(replacement_names[0]));
+			rule.config.prefetch = name_index(prefetch, prefetch_names, sizeof(prefetch_names) / sizeof(prefetch_names[0]));
+			unsigned long lines = rule.config.ways > 0 ? rule.config.size / 32 / rule.config.ways : 0;
+
+			if (strcmp(cpus, "*") == 0)
+			{
+				rule.first = 0;
+				rule.last = ~0U;
+			}
+			else if (sscanf(cpus, "%u-%u", &rule.first, &rule.last) == 1)
+				rule.last = rule.first;
+			if (strcmp(cpus, "*") != 0 && (!isdigit(cpus[0]) || rule.last < rule.first))
+				error = "cpus must be N, N-M or *";
+			else if (rule.config.ways < 1 || rule.config.ways > 16)
+				error = "ways must be 1 to 16";
+			else if (lines == 0 || lines * 32 * rule.config.ways != rule.config.size || (lines & (lines - 1)))
+				error = "size must be 32 bytes times ways times a power of two";
+			else if (rule.config.policy < 0)
+				error = "unknown replacement policy";
+			else if (rule.config.policy == REPLACE_PLRU && (rule.config.ways & (rule.config.ways - 1)))
+				error = "plru needs a power of two ways";
+			else if (rule.config.hit_cycles < 1 || rule.config.hit_cycles > 1000)
+				error = "hit latency must be 1 to 1000 cycles";
+			else if (rule.config.prefetch < 0)
+				error = "unknown prefetcher";
+		}
+		if (error)
+		{
+			cerr << path << ":" << n << ": " << error << endl;
+			exit(1);
+		}
+		cache_config_rules.push_back(rule);
+	}
+	fclose(f);
+}
+
+// configuration of the cache of a CPU
+CacheConfig cache_config(unsigned int cpu)
+{
+	CacheConfig config = { CACHE_SETS * CACHE_LINES * 32, CACHE_SETS, REPLACE_PLRU, 1, PREFETCH_NONE };
+	for (size_t i = 0; i < cache_config_rules.size(); i++)
+		if (cpu >= cache_config_rules[i].first && cpu <= cache_config_rules[i].last)
+			config = cache_config_rules[i].config;
+	return config;
+}
+
+void parse_options(int *argc, char ***argv)
+{
+	int kept = 1;
+	for (int i = 1; i < *argc; i++)
+	{
+		char *arg = (*argv)[i];
+		const char *value;
+
+		if (strcmp(arg, "--parallel") == 0)
+			opt_parallel = true;
+		else if (option_value(arg, "--quantum", &value))
+			opt_quantum = atol(value);
+		else if (option_value(arg, "--shards", &value))
+			opt_shards = atoi(value);
+		else if (option_value(arg, "--trace", &value))
+		{
+			opt_trace = 0;
+			if (strstr(value, "clk") || strstr(value, "all"))
+				opt_trace |= TRACE_CLK;
+			if (strstr(value, "cpu") || strstr(value, "all"))
+				opt_trace |= TRACE_CPU;
+			if (strstr(value, "bus") || strstr(value, "all"))
+				opt_trace |= TRACE_BUS;
+		}
+		else if (option_value(arg, "--trace-start", &value))
+			opt_trace_start = atol(value);
+		else if (option_value(arg, "--trace-stop", &value))
+			opt_trace_stop = atol(value);
+		else if (option_value(arg, "--trace-trigger", &value))
+		{
+			opt_trace_trigger = true;
+			opt_trace_addr = strtoul(value, NULL, 0);
+		}
+		else if (strcmp(arg, "--trace-gz") == 0)
+			opt_trace_gz = true;
+		else if (option_value(arg, "--trace-file", &value))
+			opt_trace_file = value;
+		else if (strcmp(arg, "--bench") == 0)
+			opt_bench = true;
+		else if (strcmp(arg, "--check") == 0)
+			opt_check = true;
+		else if (option_value(arg, "--sector", &value))
+			opt_sector = atoi(value);
+		else if (option_value(arg, "--victim", &value))
+			opt_victim = atoi(value);
+		else if (option_value(arg, "--channels", &value))
+			opt_channels = atoi(value);
+		else if (option_value(arg, "--channel-cycles", &value))
+			opt_channel_cycles = atoi(value);
+		else if (option_value(arg, "--server", &value))
+			opt_server = value;
+		else if (option_value(arg, "--server-jobs", &value))
+			opt_server_jobs = atoi(value);
+		else if (option_value(arg, "--server-dir", &value))
+			opt_server_dir = value;
+		else if (option_value(arg, "--interval", &value))
+			opt_interval = atol(value);
+		else if (option_value(arg, "--phases", &value))
+			opt_phases = atoi(value);
+		else if (option_value(arg, "--tlb", &value))
+			opt_tlb = atoi(value);
+		else if (option_value(arg, "--tlb-ways", &value))
+			opt_tlb_ways = atoi(value);
+		else if (option_value(arg, "--page-colors", &value))
+			opt_page_colors = atoi(value);
+		else if (option_value(arg, "--page-size", &value))
+			opt_page_size = size_value(value);
+		else if (option_value(arg, "--cache-config", &value))
+			opt_cache_config = value;
+		else if (option_value(arg, "--page-alloc", &value))
+		{
+			opt_page_alloc = name_index(value, page_alloc_names, sizeof(page_alloc_names) / sizeof(page_alloc_names[0]));
+			if (opt_page_alloc < 0)
+			{
+				cerr << "Unknown page allocation " << value << endl;
+				exit(1);
+			}
+		}
+		else if (option_value(arg, "--interleave", &value))
+		{
+			opt_interleave = name_index(value, interleave_names, sizeof(interleave_names) / sizeof(interleave_names[0]));
+			if (opt_interleave < 0)
+			{
+				cerr << "Unknown interleaving " << value << endl;
+				exit(1);
+			}
+		}
+		else if (option_value(arg, "--protocol", &value))
+		{
+			opt_protocol = name_index(value, protocol_names, sizeof(protocol_names) / sizeof(protocol_names[0]));
+			if (opt_protocol < 0)
+			{
+				cerr << "Unknown protocol " << value << endl;
+				exit(1);
+			}
+		}
+		else if (option_value(arg, "--synth", &value))
+		{
+			// "none" is the default, not a workload
+			opt_synth = name_index(value, synth_names, sizeof(synth_names) / sizeof(synth_names[0]));
+			if (opt_synth <= 0)
+			{
+				cerr << "Unknown synthetic workload " << value << endl;
+				exit(1);
+			}
+		}
+		else if (option_value(arg, "--cpus", &value))
+			opt_cpus = atoi(value);
+		else if (option_value(arg, "--accesses", &value))
+			opt_accesses = atol(value);
+		else if (option_value(arg, "--wss", &value))
+			opt_wss = strtoul(value, NULL, 0);
+		else if (option_value(arg, "--seed", &value))
+			opt_seed = strtoul(value, NULL, 0);
+		else if (option_value(arg, "--write-ratio", &value))
+			opt_write_ratio = atoi(value);
+		else if (option_value(arg, "--nop", &value))
+			opt_nop_ratio = atoi(value);
+		else if (option_value(arg, "--stride", &value))
+			opt_stride = strtoul(value, NULL, 0);
+		else if (option_value(arg, "--zipf", &value))
+			opt_zipf = atof(value);
+		else
+			(*argv)[kept++] = arg;
+	}
+	*argc = kept;
+
+	if (opt_quantum < 1)
+	{
+		cerr << "Quantum must be at least one cycle" << endl;
+		exit(1);
+	}
+	if (opt_synth && (opt_cpus < 1 || opt_accesses < 1))
+	{
+		cerr << "--synth needs at least one CPU and one access" << endl;
+		exit(1);
+	}
+	if (opt_synth >= SYNTH_SPINLOCK && (opt_shards || opt_parallel))
+	{
+		cerr << "Lock workloads are only modelled by the detailed simulation" << endl;
+		exit(1);
+	}
+	if (opt_sector != 1 && opt_sector != 2 && opt_sector != 4 && opt_sector != 8)
+	{
+		cerr << "--sector must be 1, 2, 4 or 8 words" << endl;
+		exit(1);
+	}
+	if (opt_victim && (opt_victim < 4 || opt_victim > 16))
+	{
+		cerr << "--victim takes 4 to 16 entries" << endl;
+		exit(1);
+	}
+	if (opt_channels < 0 || opt_channel_cycles < 1)
+	{
+		cerr << "--channels must not be negative and --channel-cycles must be at least 1" << endl;
+		exit(1);
+	}
+	if (opt_tlb && (opt_tlb < 0 || opt_tlb_ways < 1 || opt_tlb % opt_tlb_ways != 0))
+	{
+		cerr << "--tlb must be a multiple of --tlb-ways" << endl;
+		exit(1);
+	}
+	if (opt_page_size < 4096 || opt_page_size > (4UL << 20) || (opt_page_size & (opt_page_size - 1)) || opt_page_colors < 1)
+	{
+		cerr << "--page-size must be a power of two from 4k to 4m, --page-colors at least 1" << endl;
+		exit(1);
+	}
+	if (opt_server && opt_server_jobs < 1)
+	{
+		cerr << "--server-jobs must be at least 1" << endl;
+		exit(1);
+	}
+	if (opt_interval < 0 || opt_phases < 1)
+	{
+		cerr << "--interval must not be negative and --phases must be at least 1" << endl;
+		exit(1);
+	}
+	if ((opt_protocol != PROTOCOL_INVALIDATE || opt_sector != 8 || opt_victim || opt_channels || opt_tlb || opt_interval
+		|| opt_cache_config) && (opt_shards || opt_parallel))
+	{
+		cerr << "Write-update protocols, sectors, victim caches, memory channels, translation, interval sampling"
+			" and per-CPU caches are only modelled by the detailed simulation" << endl;
+		exit(1);
+	}
+	if (opt_cache_config)
+		load_cache_config(opt_cache_config);
+	if (opt_shards < 0 || (opt_shards && opt_parallel))
+	{
+		cerr << "--shards takes a positive worker count and excludes --parallel" << endl;
+		exit(1);
+	}
+}
+
+/* Clock period of the run, set in sc_main */
+sc_time clk_period;
+
+/* Reads and writes simulated, for the --bench host metrics */
+long sim_accesses = 0;
+
+/* Atomic operations, carried by Cache::FUNC_ATOMIC */
+enum Atomic
+{
+	ATOMIC_NONE,
+	ATOMIC_TAS,	// test-and-set: returns the old value, stores 1
+	ATOMIC_FAA,	// fetch-and-add: returns the old value, adds the operand
+	ATOMIC_CAS,	// compare-and-swap: returns the old value, stores the operand if it was the expected one
+	ATOMIC_LL,	// load-linked: a read that reserves the line
+	ATOMIC_SC	// store-conditional: stores if the reservation held, returns 1 on success
+};
+
+/*
+ * Values of the lock workloads' variables. The caches only model timing and
+ * fill lines with random data, so with sync_values set reads, writes and
+ * atomics also go through this functional image of memory.
+ */
+bool sync_values = false;
+unordered_map<uint32_t, int> sync_memory;
+
+// atomic update of the image, returns what the operation returns
+static int sync_rmw(int atomic, uint32_t addr, int operand, int expected)
+{
+	int &word = sync_memory[addr];
+	int old = word;
+
+	switch (atomic)
+	{
+		case ATOMIC_TAS:
+			word = 1;
+			break;
+		case ATOMIC_FAA:
+			word += operand;
+			break;
+		case ATOMIC_CAS:
+			if (old == expected)
+				word = operand;
+			break;
+		case ATOMIC_SC:
+			word = operand;
+			return 1;
+	}
+	return old;
+}
+
+static inline long now_cycles()
+{
+	return (long)(sc_time_stamp() / clk_period);
+}
+
+/*
+ * Same as wait(n) for a thread sensitive to the rising clock edge, but
+ * sleeps through the first n-1 cycles on one timed wait instead of being
+ * triggered on every edge. Waking half a cycle before the last edge and
+ * then waiting for it resumes in the same delta cycle as wait(n) would.
+ */
+static void wait_cycles(long n)
 {
+	if (n > 1)
+		wait(clk_period * (double)(n - 1) + clk_period / 2);
+	if (n > 0)
+		wait();
+}
 
+/*
+ * Main memory behind --channels controllers. Without channels every
+ * transfer takes 100 cycles per word, as if bandwidth were unlimited. With
+ * them, lines are spread over the channels by --interleave (line address,
+ * page address, or an XOR of line and page bits), each channel serves its
+ * transfers in arrival order and is busy --channel-cycles per word, so a
+ * transfer waits for the ones queued before it and then takes 100 cycles
+ * per word.
+ */
+class MemorySystem
+{
 	public:
-		enum BUS_REQ 
+		struct Channel
 		{
-			BUS_RD,
-			BUS_WR,
-			BUS_RDX,//-> seems have same response with BUS_WR
-			BUS_INVALID
+			long transfers;
+			long words;
+			long busy;		// cycles occupied
+			long queued;		// cycles transfers waited for the channel
+			long max_queue;		// transfers in the channel when one arrived
+			long free_at;		// cycle the channel takes the next transfer
+			deque<long> pending;	// cycles the queued transfers leave the channel
 		};
 
-		enum Function 
+		vector<Channel> channels;
+
+		void init(int n)
+		{
+			Channel c = { 0, 0, 0, 0, 0, 0, deque<long>() };
+			channels.assign(n, c);
+		}
+
+		int channel_of(uint32_t addr) const
+		{
+			uint32_t line = addr >> 5;
+			uint32_t page = addr >> 12;
+			switch (opt_interleave)
+			{
+				case INTERLEAVE_PAGE:
+					return page % channels.size();
+				case INTERLEAVE_XOR:
+					return (line ^ page ^ (page >> 7)) % channels.size();
+				default:
+					return line % channels.size();
+			}
+		}
+
+		// queue a transfer of words at addr, returns the cycles until it is done
+		long transfer(uint32_t addr, int words)
+		{
+			if (channels.empty() || words == 0)
+				return (long)words * 100;
+
+			Channel &c = channels[channel_of(addr)];
+			long now = now_cycles();
+			while (!c.pending.empty() && c.pending.front() <= now)
+				c.pending.pop_front();
+			c.max_queue = max(c.max_queue, (long)c.pending.size());
+
+			long start = max(now, c.free_at);
+			c.free_at = start + (long)words * opt_channel_cycles;
+			c.pending.push_back(c.free_at);
+			c.transfers++;
+			c.words += words;
+			c.busy += (long)words * opt_channel_cycles;
+			c.queued += start - now;
+			return start - now + (long)words * 100;
+		}
+};
+
+MemorySystem memory;
+
+/*
+ * One address space shared by all CPUs (the trace addresses are virtual
+ * when --tlb is on). A radix page table of 1024-entry levels over the
+ * virtual page number, so 4k pages take a two level walk and 4m pages a
+ * single level, lives in physical memory from PT_BASE up. Frames are
+ * handed out on first touch from PHYS_SIZE bytes: in order, at random, or
+ * keeping the low --page-colors bits of the page number (page coloring,
+ * which keeps pages apart in the page interleaved memory channels; the
+ * cache index lies within the 4k page offset).
+ */
+#define PT_BASE		0x40000000
+#define PHYS_SIZE	0x40000000
+
+class PageTable
+{
+	public:
+		PageTable() : page_bits(12), levels(2), next_frame(0), next_node(1), rng(1) {}
+
+		void init(unsigned long page_size, unsigned long seed)
+		{
+			page_bits = __builtin_ctzl(page_size);
+			levels = (32 - page_bits + 9) / 10;
+			frames = PHYS_SIZE >> page_bits;
+			rng = seed * 0x9E3779B97F4A7C15UL + 1;
+			color_next.assign(opt_page_colors, 0);
+		}
+
+		int walk_levels() const { return levels; }
+		unsigned long pages() const { return frame_of.size(); }
+
+		uint32_t vpn(uint32_t vaddr) const { return vaddr >> page_bits; }
+
+		// physical address of the entry the walk reads at level (0 is the root)
+		uint32_t pte_addr(uint32_t vaddr, int level)
+		{
+			uint32_t v = vpn(vaddr);
+			int shift = 10 * (levels - 1 - level);
+			uint64_t key = ((uint64_t)level << 32) | (level ? v >> (shift + 10) : 0);
+			unordered_map<uint64_t, uint32_t>::iterator it = nodes.find(key);
+			uint32_t node;
+			if (it == nodes.end())
+				node = nodes[key] = level ? next_node++ : 0;
+			else
+				node = it->second;
+			return PT_BASE + node * 4096 + ((v >> shift) & 1023) * 4;
+		}
+
+		// physical frame of the virtual page, allocated on first touch
+		uint32_t frame(uint32_t v)
+		{
+			unordered_map<uint32_t, uint32_t>::iterator it = frame_of.find(v);
+			if (it != frame_of.end())
+				return it->second;
+			if (frame_of.size() == frames)
+			{
+				cerr << "Out of physical memory for virtual page " << v << endl;
+				exit(1);
+			}
+
+			uint32_t f = 0;
+			switch (opt_page_alloc)
+			{
+				case PAGE_ALLOC_SEQUENTIAL:
+					f = next_frame++;
+					break;
+				case PAGE_ALLOC_RANDOM:
+					f = random() % frames;
+					while (used.count(f))
+						f = (f + 1) % frames;
+					break;
+				case PAGE_ALLOC_COLOR:
+				{
+					uint32_t color = v % opt_page_colors;
+					// the next free frame of the page's color, any frame once the color is used up
+					do
+						f = color + opt_page_colors * color_next[color]++;
+					while (f < frames && used.count(f));
+					if (f >= frames)
+						for (f = 0; used.count(f); f++)
+							;
+					break;
+				}
+			}
+			used.insert(f);
+			frame_of[v] = f;
+			return f;
+		}
+
+		uint32_t translate(uint32_t vaddr, uint32_t f) const
+		{
+			return (f << page_bits) | (vaddr & ((1u << page_bits) - 1));
+		}
+
+	private:
+		int page_bits;
+		int levels;
+		uint32_t frames;
+		uint32_t next_frame;
+		uint32_t next_node;
+		unsigned long rng;
+		vector<uint32_t> color_next;
+		unordered_map<uint32_t, uint32_t> frame_of;
+		unordered_set<uint32_t> used;
+		unordered_map<uint64_t, uint32_t> nodes;
+
+		// xorshift64*
+		unsigned long random()
+		{
+			rng ^= rng >> 12;
+			rng ^= rng << 25;
+			rng ^= rng >> 27;
+			return rng * 0x2545F4914F6CDD1DUL;
+		}
+};
+
+PageTable page_table;
+
+/* Entry of the set-associative TLB of a cache */
+typedef struct
+{
+	bool valid;
+	uint32_t vpn;
+	uint32_t frame;
+	unsigned long last_use; //LRU stamp
+} tlb_entry;
+
+/*
+ * Log-linear latency histogram: exact below 16 cycles, above that 8 linear
+ * buckets per power of two (at most 12.5% error). Recording is a couple of
+ * shifts and an increment.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS  ((2 << HIST_SUB_BITS) + (64 - HIST_SUB_BITS - 1) * (1 << HIST_SUB_BITS))
+
+class LatencyHistogram
+{
+	public:
+		LatencyHistogram() : count(0), max(0)
+		{
+			memset(buckets, 0, sizeof(buckets));
+		}
+
+		void record(unsigned long v)
+		{
+			buckets[bucket(v)]++;
+			count++;
+			if (v > max)
+				max = v;
+		}
+
+		// upper bound of the bucket holding the p-th percentile
+		unsigned long percentile(double p) const
+		{
+			unsigned long need = (unsigned long)(p / 100.0 * count + 0.999999);
+			unsigned long seen = 0;
+			for (int b = 0; b < HIST_BUCKETS; b++)
+			{
+				seen += buckets[b];
+				if (seen >= need && seen > 0)
+					return upper(b) < max ? upper(b) : max;
+			}
+			return max;
+		}
+
+		unsigned long count;
+		unsigned long max;
+
+	private:
+		unsigned long buckets[HIST_BUCKETS];
+
+		static int bucket(unsigned long v)
+		{
+			if (v < (2UL << HIST_SUB_BITS))
+				return v;
+			int e = 63 - __builtin_clzl(v);
+			return (2 << HIST_SUB_BITS) + ((e - HIST_SUB_BITS - 1) << HIST_SUB_BITS)
+				+ ((v >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+		}
+
+		static unsigned long upper(int b)
+		{
+			if (b < (2 << HIST_SUB_BITS))
+				return b;
+			int e = ((b - (2 << HIST_SUB_BITS)) >> HIST_SUB_BITS) + HIST_SUB_BITS + 1;
+			unsigned long sub = (b & ((1 << HIST_SUB_BITS) - 1)) + (1 << HIST_SUB_BITS);
+			return ((sub + 1) << (e - HIST_SUB_BITS)) - 1;
+		}
+};
+
+/*
+ * Miss classification for one cache (3C plus coherence). A miss on a line
+ * never seen before is compulsory. A miss on a line another cache's write
+ * invalidated is a coherence miss: true sharing when the word now accessed
+ * is one of the words written remotely since, false sharing otherwise.
+ * Any other miss is a conflict miss when a fully associative LRU cache of
+ * the same capacity would have hit, and a capacity miss when it would not.
+ */
+enum MissClass
+{
+	MISS_COMPULSORY,
+	MISS_CAPACITY,
+	MISS_CONFLICT,
+	MISS_TRUE_SHARING,
+	MISS_FALSE_SHARING,
+	MISS_CLASSES
+};
+
+class MissClassifier
+{
+	public:
+		MissClassifier(size_t lines) : capacity(lines)
+		{
+			memset(count, 0, sizeof(count));
+		}
+
+		// every access, in program order; returns the class of a miss
+		int access(unsigned int addr, bool hit)
+		{
+			unsigned int line = addr >> 5;
+			int cls = -1;
+
+			if (!hit)
+			{
+				unordered_map<unsigned int, unsigned char>::iterator inv = remote_words.find(line);
+				if (touched.find(line) == touched.end())
+					cls = MISS_COMPULSORY;
+				else if (inv != remote_words.end())
+					cls = (inv->second & (1 << ((addr >> 2) & 7))) ? MISS_TRUE_SHARING : MISS_FALSE_SHARING;
+				else if (shadow_pos.find(line) != shadow_pos.end())
+					cls = MISS_CONFLICT;
+				else
+					cls = MISS_CAPACITY;
+				count[cls]++;
+				if (inv != remote_words.end())
+					remote_words.erase(inv);
+				touched.insert(line);
+			}
+
+			// fully associative LRU shadow
+			unordered_map<unsigned int, list<unsigned int>::iterator>::iterator pos = shadow_pos.find(line);
+			if (pos != shadow_pos.end())
+				shadow.erase(pos->second);
+			else if (shadow.size() == capacity)
+			{
+				shadow_pos.erase(shadow.back());
+				shadow.pop_back();
+			}
+			shadow.push_front(line);
+			shadow_pos[line] = shadow.begin();
+			return cls;
+		}
+
+		// a remote write to addr; invalidated says whether it took our copy
+		void remote_write(unsigned int addr, bool invalidated)
+		{
+			unsigned int line = addr >> 5;
+			unordered_map<unsigned int, unsigned char>::iterator inv = remote_words.find(line);
+			if (inv == remote_words.end() && !invalidated)
+				return;
+			remote_words[line] |= 1 << ((addr >> 2) & 7);
+		}
+
+		long count[MISS_CLASSES];
+
+	private:
+		size_t capacity;
+		unordered_set<unsigned int> touched;
+		list<unsigned int> shadow;
+		unordered_map<unsigned int, list<unsigned int>::iterator> shadow_pos;
+		unordered_map<unsigned int, unsigned char> remote_words;
+};
+
+/* One line index of a cache, and what else an access there can change */
+struct CheckSet
+{
+	unsigned int line_index;
+	aca_cache_line line[16];
+	unsigned short plru;
+	unsigned long stamp[16];
+	unsigned long use_clock;
+	aca_victim_line victim[16];
+	unsigned long victim_clock;
+	bool reserved;
+	int reserve_line;
+	bool prefetching;	// a prefetch is in flight or waiting to be installed
+	int prefetch_addr;
+	bool prefetch_shared;
+	bool prefetch_snooped;
+};
+
+/* What a cache did for one access from its CPU */
+struct CheckAccess
+{
+	int addr;
+	int func;	// Cache::Function
+	int atomic;
+	int data;	// value the access wrote
+	bool hit;	// Port_Hit
+	int outcome;	// Port_Outcome
+	int set;	// way the access used, -1 if none
+	int returned;	// Port_Data to the CPU
+};
+
+/*
+ * Lockstep checking (--check), implemented by Checker. Cache and Bus
+ * hand it every state change they make, with the set before and after.
+ */
+class Check_if
+{
+	public:
+		// Cache::execute, before the lookup and before Done
+		virtual void begin_access(int cache, unsigned int line_index) = 0;
+		virtual void end_access(int cache, const CacheConfig &config, const CheckAccess &a,
+			const CheckSet &before, const CheckSet &after) = 0;
+		// Cache::snoop, one request of another cache
+		virtual void snoop(int cache, const CacheConfig &config, int req, int addr, int data,
+			const CheckSet &before, const CheckSet &after) = 0;
+		// Cache::install_prefetch, set is the way it took or -1
+		virtual void install(int cache, const CacheConfig &config, int set,
+			const CheckSet &before, const CheckSet &after) = 0;
+		// Bus::transaction, when it drives and when it releases the bus
+		virtual void bus_begin() = 0;
+		virtual void bus_end(int writer, int addr, int req, bool shared) = 0;
+		// lock workloads: a read of sync_memory, a plain write to it, and an
+		// atomic with what sync_rmw returned and left in the word
+		virtual void sync_read(int cache, int addr, int value) = 0;
+		virtual void sync_write(int cache, int addr, int value) = 0;
+		virtual void sync_atomic(int cache, int atomic, int addr, int operand, int expected,
+			int result, int stored) = 0;
+};
+Check_if *checker = NULL;
+
+SC_MODULE(Cache) 
+{
+
+	public:
+		enum BUS_REQ 
+		{
+			BUS_RD,
+			BUS_WR,
+			BUS_RDX,//-> seems have same response with BUS_WR
+			BUS_UPD,//write update of one word, Port_BusData holds it
+			BUS_INVALID
+		};
+
+		enum Function 
+		{
+			FUNC_READ,
+			FUNC_WRITE,
+			FUNC_ATOMIC // Port_Atomic says which, Port_Data carries the operand
+		};
+
+		enum RetCode 
+		{
+			RET_READ_DONE,
+			RET_WRITE_DONE,
+		};
+
+		enum Outcome
+		{
+			OUTCOME_HIT,
+			OUTCOME_MISS,
+			OUTCOME_COHERENCE_MISS //the line was invalidated by a snoop
+		};
+
+		sc_in<bool>     Port_CLK;
+		sc_in<Function> Port_Func;
+		sc_in<int>      Port_Addr;
+		sc_out<RetCode> Port_Done;
+		sc_inout_rv<32> Port_Data;
+
+		sc_out<bool> 	Port_Hit;
+		sc_out<int> 	Port_Outcome;
+		sc_in<int> 	Port_Atomic;
+		sc_in<int> 	Port_Expected;
+
+		sc_in_rv<32> 	Port_BusWriter;
+		sc_in_rv<32> 	Port_BusAddr;
+		sc_in_rv<32> 	Port_BusReq;
+		sc_in_rv<32> 	Port_BusData;
+
+		sc_port<Bus_if>	Port_Bus;
+
+		int cache_id;	
+		int snooping;
+
+		// geometry, replacement, hit latency and prefetcher of this cache
+		CacheConfig config;
+
+		MissClassifier classifier;
+
+		// reads and writes by outcome, as counted in the aca2009 statistics
+		long read_hits;
+		long read_misses;
+		long write_hits;
+		long write_misses;
+
+		// write-update traffic
+		long updates_sent;
+		long updates_received;
+		long broadcasts_skipped;
+
+		// hits, misses of an invalid sector in a present line, misses of the whole line
+		long sector_hits;
+		long sector_misses;
+		long line_misses;
+
+		// victim cache lookups after a line miss, and lines it held when displaced
+		long victim_hits;
+		long victim_misses;
+		long victim_evictions;
+
+		// atomics performed, and store-conditionals that lost their reservation
+		long atomics;
+		long sc_failures;
+
+		// translation: TLB lookups, page walk references that missed the cache, cycles walking
+		long tlb_hits;
+		long tlb_misses;
+		long walk_refs;
+		long walk_misses;
+		long walk_cycles;
+
+		// lines of this cache invalidated by snooped writes
+		long invalidations;
+
+		// next line prefetches issued, used by the CPU, waited for by the CPU
+		// while in flight, and dropped (snooped while in flight, present, or
+		// only dirty lines to replace)
+		long prefetches;
+		long prefetch_hits;
+		long prefetch_late;
+		long prefetch_dropped;
+
+		SC_HAS_PROCESS(Cache);
+
+		Cache(sc_module_name name, const CacheConfig &c) : sc_module(name), config(c), classifier(c.size / 32)
+		{
+			SC_THREAD(execute);
+			sensitive << Port_CLK.pos();
+			dont_initialize();
+
+			SC_THREAD(snoop);
+			sensitive << Port_CLK.pos();
+			dont_initialize();
+
+			SC_THREAD(prefetch);
+			sensitive << Port_CLK.pos();
+			dont_initialize();
+
+			//m_data = new int[MEM_SIZE];
+			ways = config.ways;
+			lines = config.size / 32 / ways;
+			index_bits = __builtin_ctz(lines);
+			cache = new aca_cache_line[ways * lines];
+			for (int i = 0; i < ways; i++)
+				for (unsigned int j = 0; j < lines; j++){
+					cache_line(i, j)->valid = false;
+					cache_line(i, j)->snooped = false;
+					cache_line(i, j)->sector_valid = 0;
+					cache_line(i, j)->sector_dirty = 0;
+					cache_line(i, j)->prefetched = false;
+				}
+			read_hits = 0;
+			read_misses = 0;
+			write_hits = 0;
+			write_misses = 0;
+			updates_sent = 0;
+			updates_received = 0;
+			broadcasts_skipped = 0;
+			sector_hits = 0;
+			sector_misses = 0;
+			line_misses = 0;
+			victim = new aca_victim_line[opt_victim];
+			for (int i = 0; i < opt_victim; i++){
+				victim[i].line.valid = false;
+				victim[i].line.snooped = false;
+				victim[i].last_use = 0;
+			}
+			victim_clock = 0;
+			victim_hits = 0;
+			victim_misses = 0;
+			victim_evictions = 0;
+			atomics = 0;
+			sc_failures = 0;
+			reserved = false;
+			reserve_line = 0;
+			tlb = new tlb_entry[opt_tlb];
+			for (int i = 0; i < opt_tlb; i++)
+				tlb[i].valid = false;
+			tlb_clock = 0;
+			tlb_hits = 0;
+			tlb_misses = 0;
+			walk_refs = 0;
+			walk_misses = 0;
+			walk_cycles = 0;
+			invalidations = 0;
+			prefetches = 0;
+			prefetch_hits = 0;
+			prefetch_late = 0;
+			prefetch_dropped = 0;
+			prefetch_state = PREFETCH_IDLE;
+			prefetch_addr = 0;
+			prefetch_shared = false;
+			prefetch_snooped = false;
+			lru_table= new unsigned short[lines] ;
+			use_stamp = new unsigned long[ways * lines];
+			use_clock = 0;
+			valid_lines = new bool[ways];
+			for (int i = 0; i<ways; i++)
+				valid_lines[i] = false;
+			for (unsigned int j = 0; j< lines; j++)
+				lru_table[j] = 0;
+			for (unsigned int j = 0; j < ways * lines; j++)
+				use_stamp[j] = 0;
+		}
+
+		~Cache() 
+		{
+			//delete[] m_data;
+			delete[] cache;
+			delete[] lru_table;
+			delete[] use_stamp;
+			delete[] valid_lines;
+			delete[] victim;
+			delete[] tlb;
+
+		}
+	private:
+		aca_cache_line *cache;	// ways * lines, way by way
+		int ways;
+		unsigned int lines;	// line indices, a power of two
+		int index_bits;
+		unsigned short *lru_table;
+		unsigned long *use_stamp;	// per line: last use for LRU, fill for FIFO
+		unsigned long use_clock;
+		bool *valid_lines;
+
+		// the line in way set of line_index
+		aca_cache_line *cache_line(int set, unsigned int line_index)
+		{
+			return &cache[set * lines + line_index];
+		}
+
+		unsigned int index_of(int addr)
+		{
+			return ((unsigned int)addr >> 5) & (lines - 1);
+		}
+
+		sc_uint<27> tag_of(int addr)
+		{
+			return (unsigned int)addr >> (5 + index_bits);
+		}
+
+		// address of the first word of a line
+		int line_addr(sc_uint<27> tag, unsigned int line_index)
+		{
+			return (int)(((unsigned int)tag << (5 + index_bits)) | (line_index << 5));
+		}
+
+		// next line prefetch in flight: fetching from memory, or waiting to be installed
+		enum PrefetchState
+		{
+			PREFETCH_IDLE,
+			PREFETCH_FETCHING,
+			PREFETCH_READY
+		};
+		int prefetch_state;
+		int prefetch_addr;
+		bool prefetch_shared;
+		bool prefetch_snooped;	// another cache used the line while it was in flight
+		sc_event prefetch_start;
+		sc_event prefetch_done;
+
+		// sets before and after the access or snoop handed to the checker
+		CheckSet check_before;
+		CheckSet check_after;
+		CheckSet snoop_before;
+		CheckSet snoop_after;
+
+		// line_index and the state outside the sets, for --check
+		void snapshot(CheckSet &s, unsigned int line_index)
+		{
+			s.line_index = line_index;
+			for (int i = 0; i < ways; i++){
+				s.line[i] = *cache_line(i, line_index);
+				s.stamp[i] = use_stamp[i * lines + line_index];
+			}
+			s.plru = lru_table[line_index];
+			s.use_clock = use_clock;
+			for (int i = 0; i < opt_victim; i++)
+				s.victim[i] = victim[i];
+			s.victim_clock = victim_clock;
+			s.reserved = reserved;
+			s.reserve_line = reserve_line;
+			s.prefetching = (prefetch_state != PREFETCH_IDLE);
+			s.prefetch_addr = prefetch_addr;
+			s.prefetch_shared = prefetch_shared;
+			s.prefetch_snooped = prefetch_snooped;
+		}
+
+		// hand an access to the checker, before Done
+		void check_access(Function f, int atomic, int addr, int data, bool hit, int outcome, int set, int returned)
+		{
+			CheckAccess a = { addr, f, atomic, data, hit, outcome, set, returned };
+			snapshot(check_after, index_of(addr));
+			checker->end_access(cache_id, config, a, check_before, check_after);
+		}
+		aca_victim_line *victim;
+		unsigned long victim_clock;
+		// load-linked reservation, cleared by snooped writes and evictions of the line
+		bool reserved;
+		int reserve_line;
+
+		void clear_reservation(int addr)
+		{
+			if (reserved && reserve_line == (addr & ~31))
+				reserved = false;
+		}
+		tlb_entry *tlb;
+		unsigned long tlb_clock;
+
+		/*
+		 * Virtual to physical address. The TLB is looked up in parallel
+		 * with nothing to wait for; on a miss the page table is walked from
+		 * the root, one PTE read through this cache per level, and the
+		 * least recently used way of the set is replaced.
+		 */
+		int translate(int addr)
+		{
+			uint32_t vpn = page_table.vpn(addr);
+			int sets = opt_tlb / opt_tlb_ways;
+			tlb_entry *set = &tlb[(vpn % sets) * opt_tlb_ways];
+			tlb_entry *victim_way = set;
+
+			for (int i = 0; i < opt_tlb_ways; i++){
+				if (set[i].valid && set[i].vpn == vpn){
+					tlb_hits++;
+					set[i].last_use = ++tlb_clock;
+					return page_table.translate(addr, set[i].frame);
+				}
+				if (victim_way -> valid && (!set[i].valid || set[i].last_use < victim_way -> last_use))
+					victim_way = &set[i];
+			}
+
+			tlb_misses++;
+			long start = now_cycles();
+			for (int level = 0; level < page_table.walk_levels(); level++)
+				walk_read(page_table.pte_addr(addr, level));
+			walk_cycles += now_cycles() - start;
+
+			victim_way -> valid = true;
+			victim_way -> vpn = vpn;
+			victim_way -> frame = page_table.frame(vpn);
+			victim_way -> last_use = ++tlb_clock;
+			return page_table.translate(addr, victim_way -> frame);
+		}
+
+		/*
+		 * Page walk reference: read the PTE at addr through the sets, the
+		 * victim cache and the bus like a read from the CPU. One cycle on a
+		 * hit.
+		 */
+		void walk_read(int addr)
+		{
+			unsigned int line_index = index_of(addr);
+			sc_uint<27> tag = tag_of(addr);
+			int sector = ((addr & 0x0000001C) >> 2) / opt_sector;
+			int set = -1;
+
+			walk_refs++;
+			for (int i = 0; i < ways; i++){
+				aca_cache_line *c_line = cache_line(i, line_index);
+				if (c_line -> valid && c_line -> tag == tag)
+					set = i;
+			}
+			if (set < 0 && opt_victim){
+				aca_victim_line *v = victim_lookup(line_index, tag);
+				if (v != NULL)
+					set = victim_swap(v, line_index);
+			}
+			if (set >= 0 && (cache_line(set, line_index)->sector_valid & (1 << sector)))
+				wait();
+			else{
+				bool shared = Port_Bus->read(cache_id, addr);
+				if (set < 0)
+					set = new_line(line_index, true);
+				aca_cache_line *c_line = cache_line(set, line_index);
+				fill(c_line, addr, sector, false);
+				c_line -> shared = shared;
+				walk_misses++;
+			}
+			touch(line_index, set);
+		}
+		char *binary (unsigned char v) { 
+			static char binstr[9] ; 
+			int i ; 
+
+			binstr[8] = '\0' ; 
+			for (i=0; i<8; i++) { 
+				binstr[7-i] = v & 1 ? '1' : '0' ; 
+				v = v / 2 ; 
+			} 
+
+			return binstr ; 
+		} 
+
+		void snoop()
+		{
+
+			while (true)
+			{
+#if 1
+				// not a change of Port_BusReq: back-to-back transactions with the
+				// same request leave it unchanged, and releasing the bus changes it
+				wait(Port_Bus->request_event());
+				int writer = Port_BusWriter.read().to_int();
+				if(writer != cache_id){
+					cout<<"I am cache: "<< cache_id <<"snooped"<<endl;
+
+					cout<< "Cache id: " << writer <<endl; 
+					int addr= Port_BusAddr.read().to_int();
+					aca_cache_line *c_line;
+					sc_uint<27> tag = 0;
+					unsigned int line_index;
+					line_index = index_of(addr);
+					tag = tag_of(addr);
+					int req = Port_BusReq.read().to_int();
+					cout<< "Snoooooping bussss " << req <<endl; 
+					if (checker)
+						snapshot(snoop_before, line_index);
+
+					// a line in flight to the prefetcher would miss this request
+					if (prefetch_state != PREFETCH_IDLE && (addr & ~31) == prefetch_addr)
+						prefetch_snooped = true;
+
+					switch(req)
+					{
+						case BUS_RD:
+							if (opt_protocol != PROTOCOL_INVALIDATE){
+								for ( int i=0; i <ways; i++ ){
+									c_line = cache_line(i, line_index);
+									if (c_line -> valid && c_line -> tag == tag){
+										c_line -> shared = true;
+										Port_Bus->assert_shared();
+									}
+								}
+								if ((c_line = victim_line(line_index, tag)) != NULL){
+									c_line -> shared = true;
+									Port_Bus->assert_shared();
+								}
+							}
+							/* do nothing
+							   for ( int i=0; i <ways; i++ ){
+							   c_line = cache_line(i, line_index);
+							   if (c_line -> valid == true){
+							   if ( c_line -> tag == tag){
+							//flush data to the bus
+
+							}
+
+							}
+							}
+							 */
+							ProbeReads ++;
+							break;
+						case BUS_RDX:
+
+						case BUS_WR:
+						{
+							bool invalidated = false;
+							for ( int i=0; i <ways; i++ ){
+								c_line = cache_line(i, line_index);
+								if (c_line -> valid == true){
+									if ( c_line -> tag == tag){
+										c_line -> valid = false;
+										c_line -> snooped = true;
+										invalidated = true;
+										invalidations++;
+									}
+
+								}
+							}
+							if ((c_line = victim_line(line_index, tag)) != NULL){
+								c_line -> valid = false;
+								c_line -> snooped = true;
+								invalidated = true;
+								invalidations++;
+							}
+							clear_reservation(addr);
+							classifier.remote_write(addr, invalidated);
+							ProbeWrites ++;
+						}
+
+							break;
+
+						case BUS_UPD:
+							for ( int i=0; i <=ways; i++ ){
+								// the victim cache holds the line at most once, checked last
+								if (i == ways)
+									c_line = victim_line(line_index, tag);
+								else
+									c_line = cache_line(i, line_index);
+								if (c_line != NULL && c_line -> valid && c_line -> tag == tag){
+									int word = ( addr & 0x0000001C ) >> 2;
+									if (c_line -> sector_valid & (1 << (word / opt_sector)))
+										c_line -> data[word] = Port_BusData.read().to_int();
+									c_line -> shared = true;
+									Port_Bus->assert_shared();
+									updates_received++;
+								}
+							}
+							clear_reservation(addr);
+							ProbeWrites ++;
+							break;
+
+
+						default:
+							cout<<"a invalid command was issued in the end"<<endl;
+							break;
+
+					}
+					if (checker){
+						snapshot(snoop_after, line_index);
+						checker->snoop(cache_id, config, req, addr, Port_BusData.read().to_int(), snoop_before, snoop_after);
+					}
+				}
+			wait();
+#endif
+
+			}
+
+		}
+
+		// replacement state after the CPU used way set of line_index
+		void touch(unsigned int line_index, int set)
+		{
+			if (config.policy == REPLACE_PLRU)
+				lru_touch(lru_table[line_index], set, ways);
+			else if (config.policy == REPLACE_LRU)
+				use_stamp[set * lines + line_index] = ++use_clock;
+		}
+
+		// way of line_index to replace when all are valid
+		int replace_victim(unsigned int line_index)
+		{
+			if (config.policy == REPLACE_PLRU)
+				return lru_victim(lru_table[line_index], ways);
+			if (config.policy == REPLACE_RANDOM)
+				return rand() % ways;
+			// LRU and FIFO: the oldest stamp
+			int set = 0;
+			for (int i = 1; i < ways; i++)
+				if (use_stamp[i * lines + line_index] < use_stamp[set * lines + line_index])
+					set = i;
+			return set;
+		}
+
+		// set for a new line at line_index: the first invalid one, else the policy's victim
+		int allocate(unsigned int line_index, bool *evicted)
+		{
+			int set = -1;
+			*evicted = false;
+			for (int i = 0; i < ways && set < 0; i++)
+				if (!cache_line(i, line_index)->valid)
+					set = i;
+
+			if (set < 0){
+				*evicted = true;
+				set = replace_victim(line_index); //find the cache line to replace
+				cout<< "Replacing now the cache line in set ....." << set << endl;
+			}
+			if (config.policy == REPLACE_FIFO)
+				use_stamp[set * lines + line_index] = ++use_clock;
+			return set;
+		}
+
+		/*
+		 * Write a line leaving the cache back: its dirty sectors, or all its
+		 * sectors on a read miss under the invalidation protocol, which
+		 * always paid for a write back.
+		 */
+		void write_back(aca_cache_line *c_line, unsigned int line_index, bool read)
+		{
+			int addr = line_addr(c_line -> tag, line_index);
+			if (read && opt_protocol == PROTOCOL_INVALIDATE)
+				wait_cycles(memory.transfer(addr, sector_words(c_line -> sector_valid))); //write back the previous line to mem 
+			else if (c_line -> sector_dirty)
+				wait_cycles(memory.transfer(addr, sector_words(c_line -> sector_dirty)));
+		}
+
+		// valid victim cache entry holding the line, NULL if none
+		aca_victim_line *victim_lookup(unsigned int line_index, sc_uint<27> tag)
+		{
+			for (int i = 0; i < opt_victim; i++)
+				if (victim[i].line.valid && victim[i].line_index == line_index && victim[i].line.tag == tag)
+					return &victim[i];
+			return NULL;
+		}
+
+		// the line held in the victim cache, NULL if none
+		aca_cache_line *victim_line(unsigned int line_index, sc_uint<27> tag)
+		{
+			aca_victim_line *v = victim_lookup(line_index, tag);
+			return v != NULL ? &v -> line : NULL;
+		}
+
+		/*
+		 * Make room for a new line at line_index. The replaced line moves to
+		 * the victim cache if there is one, and the line that falls out of
+		 * the victim cache, or the replaced line itself, is written back.
+		 */
+		int new_line(unsigned int line_index, bool read)
+		{
+			bool evicted;
+			int set = allocate(line_index, &evicted);
+			aca_cache_line *c_line = cache_line(set, line_index);
+
+			if (evicted)
+				clear_reservation(line_addr(c_line -> tag, line_index));
+			if (evicted && opt_victim){
+				aca_victim_line *v = &victim[0];
+				for (int i = 0; i < opt_victim && v -> line.valid; i++)
+					if (!victim[i].line.valid || victim[i].last_use < v -> last_use)
+						v = &victim[i];
+				if (v -> line.valid){
+					write_back(&v -> line, v -> line_index, read);
+					victim_evictions++;
+				}
+				v -> line = *c_line;
+				v -> line_index = line_index;
+				v -> last_use = ++victim_clock;
+			}
+			else if (evicted)
+				write_back(c_line, line_index, read);
+			c_line -> valid = false;
+			c_line -> sector_valid = 0;
+			c_line -> sector_dirty = 0;
+			return set;
+		}
+
+		/*
+		 * Swap a victim cache hit back into the sets at line_index, the line
+		 * it replaces takes its victim cache entry. One cycle.
+		 */
+		int victim_swap(aca_victim_line *v, unsigned int line_index)
+		{
+			bool evicted;
+			int set = allocate(line_index, &evicted);
+			aca_cache_line *c_line = cache_line(set, line_index);
+
+			aca_cache_line swapped = *c_line;
+			*c_line = v -> line;
+			if (evicted){
+				v -> line = swapped;
+				v -> last_use = ++victim_clock;
+			}
+			else
+				v -> line.valid = false;
+			wait();
+			return set;
+		}
+
+		// load the sector of the memory line at addr into c_line and make it valid,
+		// with prefetch the next line goes out once this transfer is queued
+		void fill(aca_cache_line *c_line, int addr, int sector, bool prefetch)
+		{
+			sc_uint<27> tag = tag_of(addr);
+			long done = now_cycles() + memory.transfer(addr, opt_sector); //fetch the words of the sector from memory to cache
+			if (prefetch)
+				start_prefetch(addr);
+			wait_cycles(done - now_cycles());
+			for (int j = sector*opt_sector; j < (sector+1)*opt_sector; j++)
+				c_line -> data[j] = rand()%10000;
+			c_line -> sector_valid |= 1 << sector;
+			c_line -> valid = true;
+			c_line -> snooped = false;
+			c_line -> prefetched = false;
+			c_line -> tag = tag;
+		}
+
+		// words in the sectors of mask
+		static int sector_words(unsigned char mask)
+		{
+			return __builtin_popcount(mask) * opt_sector;
+		}
+
+		// the line at addr is in the sets or the victim cache
+		bool present(int addr)
+		{
+			unsigned int line_index = index_of(addr);
+			sc_uint<27> tag = tag_of(addr);
+			for (int i = 0; i < ways; i++)
+				if (cache_line(i, line_index)->valid && cache_line(i, line_index)->tag == tag)
+					return true;
+			return victim_line(line_index, tag) != NULL;
+		}
+
+		/*
+		 * Next line prefetch on a miss at addr. The request goes on the
+		 * bus right behind the miss, the prefetch thread then waits for
+		 * memory alongside the fill and while the CPU goes on. One
+		 * prefetch is in flight at a time.
+		 */
+		void start_prefetch(int addr)
+		{
+			int next = (addr & ~31) + 32;
+			if (config.prefetch != PREFETCH_NEXT || prefetch_state != PREFETCH_IDLE || present(next))
+				return;
+			prefetch_addr = next;
+			prefetch_snooped = false;
+			prefetch_shared = Port_Bus->read(cache_id, next);
+			prefetch_state = PREFETCH_FETCHING;
+			prefetches++;
+			prefetch_start.notify();
+		}
+
+		void prefetch()
+		{
+			while (true)
+			{
+				wait(prefetch_start);
+				wait_cycles(memory.transfer(prefetch_addr, 8));
+				prefetch_state = PREFETCH_READY;
+				prefetch_done.notify();
+			}
+		}
+
+		/*
+		 * Put a fetched prefetch into the sets, called by execute() between
+		 * two accesses so it never races with a miss being handled. It
+		 * only takes an invalid or clean way, a clean line is dropped
+		 * rather than moved to the victim cache, and nothing is written
+		 * back. A prefetch another cache used the line of in flight, or
+		 * that the CPU fetched itself meanwhile, is dropped. Returns the
+		 * way it took or would have taken, -1 if it did not get that far.
+		 */
+		int install_prefetch()
+		{
+			unsigned int line_index = index_of(prefetch_addr);
+			int set = -1;
+
+			prefetch_state = PREFETCH_IDLE;
+			if (prefetch_snooped || present(prefetch_addr)){
+				prefetch_dropped++;
+				return set;
+			}
+			for (int i = 0; i < ways && set < 0; i++)
+				if (!cache_line(i, line_index)->valid)
+					set = i;
+			if (set < 0)
+				set = replace_victim(line_index);
+			aca_cache_line *c_line = cache_line(set, line_index);
+			if (c_line -> valid && c_line -> sector_dirty){
+				prefetch_dropped++;
+				return set;
+			}
+			if (c_line -> valid)
+				clear_reservation(line_addr(c_line -> tag, line_index));
+			if (config.policy == REPLACE_FIFO)
+				use_stamp[set * lines + line_index] = ++use_clock;
+
+			for (int j = 0; j < 8; j++)
+				c_line -> data[j] = rand()%10000;
+			c_line -> sector_valid = (1 << (8 / opt_sector)) - 1;
+			c_line -> sector_dirty = 0;
+			c_line -> valid = true;
+			c_line -> snooped = false;
+			c_line -> shared = prefetch_shared;
+			c_line -> prefetched = true;
+			c_line -> tag = tag_of(prefetch_addr);
+			touch(line_index, set);
+			return set;
+		}
+
+		void execute() 
+		{
+			while (true)
+			{
+				cout<<"waiting for wr function"<< cache_id << endl;
+				wait(Port_Func.value_changed_event());
+				cout<<"I am cache: "<< cache_id <<endl;
+
+				Function f = Port_Func.read();
+				int addr   = Port_Addr.read();
+				// atomics other than load-linked hold the bus from lookup to done
+				int atomic = (f == FUNC_ATOMIC) ? Port_Atomic.read() : ATOMIC_NONE;
+				bool locked = (atomic != ATOMIC_NONE && atomic != ATOMIC_LL);
+				// the CPU drives the write data for one cycle, take it before anything waits
+				int cpu_data = (f == FUNC_WRITE || locked) ? Port_Data.read().to_int() : 0;
+				if (opt_tlb)
+					addr = translate(addr);
+				// a miss on the line in flight waits for the prefetch rather than fetching it again
+				if (prefetch_state == PREFETCH_FETCHING && (addr & ~31) == prefetch_addr){
+					prefetch_late++;
+					wait(prefetch_done);
+				}
+				if (prefetch_state == PREFETCH_READY){
+					unsigned int index = index_of(prefetch_addr);
+					if (checker)
+						snapshot(check_before, index);
+					int set = install_prefetch();
+					if (checker){
+						snapshot(check_after, index);
+						checker->install(cache_id, config, set, check_before, check_after);
+					}
+				}
+				if (f == FUNC_ATOMIC)
+					atomics++;
+				if (locked)
+					Port_Bus->lock(cache_id);
+				//Port_Wr_Func.write(f);
+				//int *data;
+				aca_cache_line *c_line;
+				sc_uint<27> tag = 0;
+				unsigned int line_index;
+				unsigned int word_index = 0;
+				bool hit   = false;
+				bool coherence_miss = false;
+				int hit_set = -1;
+				//cout << sc_time_stamp() << " Function is " << f << endl;
+
+				//determine whether a hit
+				cout << "addr: " << hex << addr << endl;
+				line_index = index_of(addr);
+				tag = tag_of(addr);
+				cout << "line_index: " << line_index <<  " tag: " <<tag << endl;
+				word_index = ( addr & 0x0000001C ) >> 2;
+				if (checker){
+					checker->begin_access(cache_id, line_index);
+					snapshot(check_before, line_index);
+				}
+				for ( int i=0; i <ways; i++ ){
+					c_line = cache_line(i, line_index);
+					if (c_line -> valid == true){
+						valid_lines[i] = true;	
+						if ( c_line -> tag == tag){
+							hit = true;
+							hit_set=i; 
+						}
+
+					}
+					else{
+						valid_lines[i] = false;
+						if (c_line -> snooped && c_line -> tag == tag)
+							coherence_miss = true;
+					}
+				}
+				// a line missing from the sets may sit in the victim cache, checked in parallel
+				if (!hit && opt_victim){
+					aca_victim_line *v = victim_lookup(line_index, tag);
+					if (v != NULL){
+						hit_set = victim_swap(v, line_index);
+						hit = true;
+						victim_hits++;
+					}
+					else{
+						victim_misses++;
+						for (int i = 0; i < opt_victim; i++)
+							if (victim[i].line.snooped && victim[i].line_index == line_index && victim[i].line.tag == tag)
+								coherence_miss = true;
+					}
+				}
+				// a present line can still miss on an invalid sector
+				int sector = word_index / opt_sector;
+				bool sector_miss = hit && !(cache_line(hit_set, line_index)->sector_valid & (1 << sector));
+				classifier.access(addr, hit);
+				if (sector_miss){
+					hit = false;
+					sector_misses++;
+				}
+				else if (hit)
+					sector_hits++;
+				else
+					line_misses++;
+				if (hit && cache_line(hit_set, line_index)->prefetched){
+					prefetch_hits++;
+					cache_line(hit_set, line_index)->prefetched = false;
+				}
+				// lookup latency beyond the one cycle of the built-in cache
+				wait_cycles(config.hit_cycles - 1);
+#ifdef MASK
+
+				cout << "before replacing--------------" <<endl;
+				cout<<"lru_table: "<<binary(lru_table[line_index])<<endl;
+				cout <<setw(8) << "set"<< setw(8) <<  "valid" << setw(8) <<  "tag" <<endl;
+#endif
+				for (int set = 0; set < ways; set++){ 
+					c_line = cache_line(set, line_index);
+#ifdef MASK
+					cout <<setw(8)<<  set <<setw(8) << c_line -> valid << setw(8)<< c_line -> tag <<endl; 
+#endif
+				}
+
+				// a store-conditional that lost its reservation fails without a bus write
+				if (atomic == ATOMIC_SC && !(reserved && reserve_line == (addr & ~31)))
+				{
+					sc_failures++;
+					Port_Hit.write(hit);
+					Port_Outcome.write(OUTCOME_HIT);
+					wait();
+					Port_Data.write(0);
+					Port_Bus->unlock(cache_id);
+					if (checker)
+						check_access(f, atomic, addr, cpu_data, hit, OUTCOME_HIT, hit_set, 0);
+					Port_Done.write( RET_WRITE_DONE );
+					wait();
+					Port_Data.write("ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ");
+					continue;
+				}
+
+				int access_set = hit_set;	// way the access ends up using
+				int outcome = hit ? OUTCOME_HIT : coherence_miss ? OUTCOME_COHERENCE_MISS : OUTCOME_MISS;
+				if (f == FUNC_WRITE || locked) 
+				{
+					bool write_through = true;
+					int result = 0;
+
+					if (locked){
+						int operand = cpu_data, expected = Port_Expected.read();
+						result = sync_rmw(atomic, addr, operand, expected);
+						cpu_data = sync_memory[addr];
+						reserved = false;
+						if (checker)
+							checker->sync_atomic(cache_id, atomic, addr, operand, expected, result, cpu_data);
+					}
+					else if (sync_values){
+						sync_memory[addr] = cpu_data;
+						if (checker)
+							checker->sync_write(cache_id, addr, cpu_data);
+					}
+
+					cout << sc_time_stamp() << ": MEM received write" << endl;
+					if (hit){ //write hit
+						c_line = cache_line(hit_set, line_index);
+						if (opt_protocol == PROTOCOL_INVALIDATE || locked){
+							// atomics take the line exclusively in every protocol
+							Port_Bus->write(cache_id, addr, cpu_data);//issue bus write for a write hit 
+							write_through = (opt_protocol == PROTOCOL_INVALIDATE);
+							c_line -> shared = false;
+						}
+						else if (c_line -> shared){
+							// Firefly writes shared lines through, Dragon only updates the sharers
+							write_through = (opt_protocol == PROTOCOL_FIREFLY);
+							c_line -> shared = Port_Bus->update(cache_id, addr, cpu_data);
+							updates_sent++;
+						}
+						else{
+							// nobody else holds the line, no broadcast
+							write_through = false;
+							broadcasts_skipped++;
+						}
+						stats_writehit(cache_id);
+						write_hits++;
+
+						Port_Hit.write(true);
+						Port_Outcome.write(OUTCOME_HIT);
+						//Port_Hit_Line.write(hit_set);
+
+						c_line -> data[word_index] = cpu_data;
+						wait();//consume 1 cycle
+						cout << sc_time_stamp() << ": Cache write hit!" << endl;
+						touch(line_index, hit_set);
+					}
+					else //write miss
+					{		
+						bool shared = false;
+						if (opt_protocol == PROTOCOL_INVALIDATE || locked)
+							Port_Bus->writex(cache_id, addr, cpu_data);//issue bus readx when write miss -> didnt see rdx in this case
+						else
+							shared = Port_Bus->read(cache_id, addr);
+						stats_writemiss(cache_id);
+						write_misses++;
+
+						Port_Hit.write(false);
+						Port_Outcome.write(outcome);
+						cout << sc_time_stamp() << ": Cache write miss!" << endl;
+
+						int set = sector_miss ? hit_set : new_line(line_index, false);
+						access_set = set;
+						c_line = cache_line(set, line_index);
+						fill(c_line, addr, sector, !locked); // write allocate
+						c_line -> data[word_index] = cpu_data; //actual write from processor to cache line
+						touch(line_index, set);
+
+						if (opt_protocol != PROTOCOL_INVALIDATE){
+							write_through = shared && (opt_protocol == PROTOCOL_FIREFLY);
+							if (shared){
+								shared = Port_Bus->update(cache_id, addr, cpu_data);
+								updates_sent++;
+							}
+							c_line -> shared = shared;
+						}
+					}
+					if (write_through){
+						c_line -> sector_dirty &= ~(1 << sector);
+						wait_cycles(memory.transfer(addr, opt_sector)); //write the sector back to the memory
+					}
+					else
+						c_line -> sector_dirty |= 1 << sector;
+					if (locked){
+						Port_Data.write(result);
+						Port_Bus->unlock(cache_id);
+					}
+					if (checker)
+						check_access(f, atomic, addr, cpu_data, hit, outcome, access_set, result);
+					Port_Done.write( RET_WRITE_DONE );
+					if (locked){
+						wait();
+						Port_Data.write("ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ");
+					}
+				}
+				else//a read comes to cache
+				{
+					int returned;
+					cout << sc_time_stamp() << ": MEM received read" << endl;
+
+					if (hit){ //read hit
+						stats_readhit(cache_id);// do nothing for a read hit.
+						read_hits++;
+
+						Port_Hit.write(true);
+						Port_Outcome.write(OUTCOME_HIT);
+						//Port_Hit_Line.write(hit_set);
+						c_line = cache_line(hit_set, line_index);
+
+						returned = sync_values ? sync_memory[addr] : c_line -> data[word_index];
+						if (sync_values && checker)
+							checker->sync_read(cache_id, addr, returned);
+						Port_Data.write(returned);
+						cout << sc_time_stamp() << ": Cache read hit!" << endl;
+						touch(line_index, hit_set);
+					}
+					else //read miss
+					{		
+						bool shared = Port_Bus->read(cache_id, addr); // issue a bus read for a read miss
+						stats_readmiss(cache_id);
+						read_misses++;
+
+						Port_Hit.write(false);
+						Port_Outcome.write(outcome);
+						cout << sc_time_stamp() << ": Cache read miss!" << endl;
+
+						int set = sector_miss ? hit_set : new_line(line_index, true);
+						access_set = set;
+						c_line = cache_line(set, line_index);
+						fill(c_line, addr, sector, true);
+						c_line -> shared = shared;
+						returned = sync_values ? sync_memory[addr] : c_line -> data[word_index];
+						if (sync_values && checker)
+							checker->sync_read(cache_id, addr, returned);
+						Port_Data.write(returned); //return data to the CPU
+						touch(line_index, set);
+					}
+					// no wait between sampling the value and taking the reservation,
+					// a write snooped in between would not clear it
+					if (atomic == ATOMIC_LL){
+						reserved = true;
+						reserve_line = addr & ~31;
+					}
+
+					if (checker)
+						check_access(f, atomic, addr, 0, hit, outcome, access_set, returned);
+					Port_Done.write( RET_READ_DONE );
+					wait();
+					Port_Data.write("ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ");
+				}
+#ifdef MASK
+				//at here means a read or a write has happened
+				cout << "after replacing----------------------" <<endl;
+				cout <<"lru_table: "<<binary(lru_table[line_index])<<endl;
+				//cout <<"use invalid line in set: "<<
+				cout <<setw(8) << "set"<< setw(8) <<  "valid" << setw(8) <<  "tag" <<endl;
+#endif
+				for (int set = 0; set < ways; set++){
+					c_line = cache_line(set, line_index);
+#ifdef MASK
+					cout <<setw(8)<<  set <<setw(8) << c_line -> valid << setw(8)<< c_line -> tag <<endl; 
+#endif
+				}
+				cout<<endl;
+
+
+				/*
+				// This simulates memory read/write delayc
+				wait(99);
+
+				if (f == FUNC_READ) 
+				{
+				//Port_Data.write( (addr < MEM_SIZE) ? m_data[addr] : 0 );
+				Port_Done.write( RET_READ_DONE );
+				wait();
+				Port_Data.write("ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ");
+				}
+				else
+				{
+				if (addr < MEM_SIZE) 
+				{
+				//	m_data[addr] = data;
+				}
+				Port_Done.write( RET_WRITE_DONE );
+				}
+				 */
+			}
+		}
+}; 
+
+class Bus : public Bus_if,public sc_module
+{
+
+	public:
+#if 0
+		enum BUS_REQ 
+		{
+			BUS_RD,
+			BUS_WR,
+			BUS_RDX,//-> seems have same response with BUS_WR
+			BUS_INVALID
+		};
+#endif
+		// ports
+		sc_in<bool> Port_CLK;
+		sc_signal_rv<32> Port_BusReq;
+		sc_signal_rv<32> Port_BusWriter;
+
+		sc_signal_rv<32> Port_BusAddr;
+		sc_signal_rv<32> Port_BusData;
+
+		sc_mutex bus;
+		sc_event request;
+		sc_event released;	// an atomic unlocked the bus
+
+		long waits;
+		long reads;
+		long writes;
+		long updates;
+		long locks;		// atomics that held the bus
+		long lock_waits;	// cycles spent waiting for the bus by them
+		long busy;		// cycles the bus was owned
+	public:
+		SC_CTOR(Bus)
+		{
+			// Handle Port_CLK to simulate delay
+			// Initialize some bus properties
+			sensitive << Port_CLK.pos();
+			Port_BusAddr.write("ZZZZZZZZZZZZZZZZZZZZZ");
+			Port_BusReq.write("ZZZZZZZZZZZZZZZZZZZZZ");
+			Port_BusWriter.write("ZZZZZZZZZZZZZZZZZZZZZ");
+			Port_BusData.write("ZZZZZZZZZZZZZZZZZZZZZ");
+
+			waits = 0;
+			reads = 0;
+			writes = 0; 
+			updates = 0;
+			locks = 0;
+			lock_waits = 0;
+			busy = 0;
+			shared = false;
+			owner = -1;
+		}
+		virtual bool read(int writer, int addr)
+		{
+			reads++;
+			return transaction(writer, addr, Cache::BUS_RD, 0);
+		}
+
+		virtual bool write(int writer, int addr, int data) 
+		{
+			writes++;
+			return transaction(writer, addr, Cache::BUS_WR, data);
+		}
+
+		virtual bool writex(int writer, int addr, int data) 
+		{
+			writes++;
+			return transaction(writer, addr, Cache::BUS_RDX, data);
+		}
+
+		virtual bool update(int writer, int addr, int data) 
+		{
+			writes++;
+			updates++;
+			return transaction(writer, addr, Cache::BUS_UPD, data);
+		}
+
+		virtual void assert_shared()
+		{
+			shared = true;
+		}
+
+		virtual const sc_event &request_event() const
+		{
+			return request;
+		}
+
+		/*
+		 * Keep the bus between the transactions of an atomic, the other
+		 * caches wait in transaction() until it is unlocked.
+		 */
+		virtual void lock(int writer)
+		{
+			locks++;
+			long start = now_cycles();
+			acquire();
+			lock_waits += now_cycles() - start;
+			owner = writer;
+			locked_at = now_cycles();
+		}
+
+		virtual void unlock(int writer)
+		{
+			if (owner != writer)
+				return;
+			owner = -1;
+			busy += now_cycles() - locked_at;
+			bus.unlock();
+			released.notify(SC_ZERO_TIME);
+		}
+
+	private:
+		bool shared;
+		int owner; // writer holding the bus locked, -1 if none
+		long locked_at;
+
+		/*
+		 * Take the mutex, counting the cycles it took in waits. A
+		 * transaction frees the bus at the next edge, so its waiters
+		 * try again every cycle. An atomic can keep the bus locked for
+		 * a memory access, its waiters sleep until unlock() and try
+		 * again in the cycle it unlocked, after the unlocking cache.
+		 */
+		void acquire()
+		{
+			long start = now_cycles();
+			while(bus.trylock() == -1){
+				if (owner != -1)
+					wait(released);
+				else
+					wait();
+			}
+			waits += now_cycles() - start;
+		}
+
+		/*
+		 * Own the bus for one cycle: take the mutex unless an atomic of
+		 * the writer holds it locked, drive the request so every cache
+		 * snoops it, then release. Returns whether any snooper pulled the
+		 * shared line.
+		 */
+		bool transaction(int writer, int addr, int req, int data)
+		{
+			cout<<"before locking mutex "<< req << " " << writer <<endl;
+			bool owned = (owner == writer);
+			if (!owned)
+				acquire();
+			shared = false;
+			if (checker)
+				checker->bus_begin();
+
+			Port_BusAddr.write(addr);
+			Port_BusWriter.write(writer);
+			Port_BusData.write(data);
+			Port_BusReq.write(req);
+			request.notify(SC_ZERO_TIME);
+
+			//wait for everyone to revieve
+			wait();
+			if (checker)
+				checker->bus_end(writer, addr, req, shared);
+			if (!owned)
+				busy++;
+			Port_BusReq.write("ZZZZZZZZZZZZZZZZZZZZZ");
+			Port_BusAddr.write("ZZZZZZZZZZZZZZZZZZZZZ");
+			Port_BusWriter.write("ZZZZZZZZZZZZZZZZZZZZZ");
+			Port_BusData.write("ZZZZZZZZZZZZZZZZZZZZZ");
+
+			if (!owned)
+				bus.unlock();
+			cout<<"after unlocking mutex "<< req << " " << writer <<endl;
+
+			return shared;
+		}
+};
+
+/* Bus request of a cache as Checker saw it */
+struct CheckBus
+{
+	int req;
+	int addr;
+	bool shared;
+};
+
+/*
+ * Golden model of one cache access, snoop or prefetch install, replayed on
+ * a copy of the set it started from. It shares only the data layout with
+ * Cache, the rules are written out again here. Memory holds no values in
+ * this model, so the words a fill brings in are taken from the cache,
+ * and with random replacement so is the victim.
+ */
+class GoldenSet
+{
+	public:
+		CheckSet s;
+		bool hit;
+		int outcome;
+		int set;
+		bool returns;		// whether returned is known
+		int returned;
+		bool asserts_shared;	// a snoop that pulls the shared line
+		char bus_error[96];	// first bus request that differs, empty if none
+
+		GoldenSet(const CacheConfig &c, const CheckSet &before, const vector<CheckBus> *bus_log)
+			: s(before), hit(false), outcome(Cache::OUTCOME_HIT), set(-1), returns(false), returned(0),
+			asserts_shared(false), config(c), log(bus_log), next(0)
+		{
+			index_bits = __builtin_ctz(config.size / 32 / config.ways);
+			bus_error[0] = '\0';
+		}
+
+		// a CPU access, actual is what the cache did
+		void access(const CheckAccess &actual, const CheckSet &after)
+		{
+			int addr = actual.addr;
+			sc_uint<27> tag = tag_of(addr);
+			int word = (addr >> 2) & 7;
+			int sector = word / opt_sector;
+			bool locked = (actual.atomic != ATOMIC_NONE && actual.atomic != ATOMIC_LL);
+			bool coherence_miss = false;
+
+			set = find(tag);
+			for (int i = 0; i < config.ways; i++)
+				if (!s.line[i].valid && s.line[i].snooped && s.line[i].tag == tag)
+					coherence_miss = true;
+			if (set < 0 && opt_victim){
+				aca_victim_line *v = find_victim(tag);
+				if (v != NULL)
+					set = swap(v, actual.set);
+				for (int i = 0; v == NULL && i < opt_victim; i++)
+					if (s.victim[i].line.snooped && s.victim[i].line_index == s.line_index && s.victim[i].line.tag == tag)
+						coherence_miss = true;
+			}
+			hit = set >= 0 && (s.line[set].sector_valid & (1 << sector));
+			outcome = hit ? Cache::OUTCOME_HIT : coherence_miss ? Cache::OUTCOME_COHERENCE_MISS : Cache::OUTCOME_MISS;
+			if (hit)
+				s.line[set].prefetched = false;
+
+			if (actual.atomic == ATOMIC_SC && !(s.reserved && s.reserve_line == (addr & ~31))){
+				outcome = Cache::OUTCOME_HIT;
+				returns = true;
+				returned = 0;
+			}
+			else if (actual.func == Cache::FUNC_WRITE || locked){
+				bool write_through = true;
+				if (locked)
+					s.reserved = false;
+				if (hit){
+					if (opt_protocol == PROTOCOL_INVALIDATE || locked){
+						bus(Cache::BUS_WR, addr);
+						write_through = (opt_protocol == PROTOCOL_INVALIDATE);
+						s.line[set].shared = false;
+					}
+					else if (s.line[set].shared){
+						write_through = (opt_protocol == PROTOCOL_FIREFLY);
+						s.line[set].shared = bus(Cache::BUS_UPD, addr);
+					}
+					else
+						write_through = false;
+					s.line[set].data[word] = actual.data;
+					touch(set);
+				}
+				else{
+					bool shared = false;
+					if (opt_protocol == PROTOCOL_INVALIDATE || locked)
+						bus(Cache::BUS_RDX, addr);
+					else
+						shared = bus(Cache::BUS_RD, addr);
+					if (set < 0)
+						set = new_line(actual.set);
+					fill(set, addr, sector, after);
+					s.line[set].data[word] = actual.data;
+					touch(set);
+					if (!locked)
+						prefetch(addr);
+					if (opt_protocol != PROTOCOL_INVALIDATE){
+						write_through = shared && (opt_protocol == PROTOCOL_FIREFLY);
+						if (shared)
+							shared = bus(Cache::BUS_UPD, addr);
+						s.line[set].shared = shared;
+					}
+				}
+				if (write_through)
+					s.line[set].sector_dirty &= ~(1 << sector);
+				else
+					s.line[set].sector_dirty |= 1 << sector;
+			}
+			else{
+				if (hit)
+					touch(set);
+				else{
+					bool shared = bus(Cache::BUS_RD, addr);
+					if (set < 0)
+						set = new_line(actual.set);
+					fill(set, addr, sector, after);
+					s.line[set].shared = shared;
+					touch(set);
+					prefetch(addr);
+				}
+				// the lock workloads read the functional image, not the line
+				returns = !sync_values;
+				returned = s.line[set].data[word];
+				if (actual.atomic == ATOMIC_LL){
+					s.reserved = true;
+					s.reserve_line = addr & ~31;
+				}
+			}
+			if (bus_error[0] == '\0' && next < log->size())
+				sprintf(bus_error, "unexpected bus %s 0x%08x", bus_name((*log)[next].req), (*log)[next].addr);
+		}
+
+		// a request of another cache seen on the bus
+		void snoop(int req, int addr, int data)
+		{
+			sc_uint<27> tag = tag_of(addr);
+			aca_victim_line *v = find_victim(tag);
+			int word = (addr >> 2) & 7;
+
+			if (s.prefetching && (addr & ~31) == s.prefetch_addr)
+				s.prefetch_snooped = true;
+			for (int i = 0; i <= config.ways; i++){
+				aca_cache_line *l = (i < config.ways) ? &s.line[i] : v != NULL ? &v -> line : NULL;
+				if (l == NULL || !l -> valid || l -> tag != tag)
+					continue;
+				if (req == Cache::BUS_RD && opt_protocol != PROTOCOL_INVALIDATE){
+					l -> shared = true;
+					asserts_shared = true;
+				}
+				else if (req == Cache::BUS_WR || req == Cache::BUS_RDX){
+					l -> valid = false;
+					l -> snooped = true;
+				}
+				else if (req == Cache::BUS_UPD){
+					if (l -> sector_valid & (1 << (word / opt_sector)))
+						l -> data[word] = data;
+					l -> shared = true;
+					asserts_shared = true;
+				}
+			}
+			if ((req == Cache::BUS_WR || req == Cache::BUS_RDX || req == Cache::BUS_UPD)
+				&& s.reserved && s.reserve_line == (addr & ~31))
+				s.reserved = false;
+		}
+
+		// a fetched prefetch put into the sets, actual is the way the cache took
+		void install(int actual, const CheckSet &after)
+		{
+			sc_uint<27> tag = tag_of(s.prefetch_addr);
+
+			s.prefetching = false;
+			if (s.prefetch_snooped || find(tag) >= 0 || find_victim(tag) != NULL)
+				return;
+			for (int i = 0; i < config.ways && set < 0; i++)
+				if (!s.line[i].valid)
+					set = i;
+			if (set < 0)
+				set = victim_way(actual);
+			aca_cache_line *l = &s.line[set];
+			if (l -> valid && l -> sector_dirty)
+				return;
+			if (l -> valid && s.reserved && s.reserve_line == line_addr(l -> tag))
+				s.reserved = false;
+			if (config.policy == REPLACE_FIFO)
+				s.stamp[set] = ++s.use_clock;
+			for (int j = 0; j < 8; j++)
+				l -> data[j] = after.line[set].data[j];
+			l -> sector_valid = (1 << (8 / opt_sector)) - 1;
+			l -> sector_dirty = 0;
+			l -> valid = true;
+			l -> snooped = false;
+			l -> shared = s.prefetch_shared;
+			l -> prefetched = true;
+			l -> tag = tag;
+			touch(set);
+		}
+
+		static const char *bus_name(int req)
+		{
+			static const char *names[] = { "RD", "WR", "RDX", "UPD" };
+			return (req >= 0 && req < 4) ? names[req] : "?";
+		}
+
+	private:
+		const CacheConfig &config;
+		const vector<CheckBus> *log;	// bus requests the cache sent during the access
+		size_t next;
+		int index_bits;
+
+		sc_uint<27> tag_of(int addr)
+		{
+			return (unsigned int)addr >> (5 + index_bits);
+		}
+
+		int line_addr(sc_uint<27> tag)
+		{
+			return (int)(((unsigned int)tag << (5 + index_bits)) | (s.line_index << 5));
+		}
+
+		int find(sc_uint<27> tag)
+		{
+			for (int i = 0; i < config.ways; i++)
+				if (s.line[i].valid && s.line[i].tag == tag)
+					return i;
+			return -1;
+		}
+
+		aca_victim_line *find_victim(sc_uint<27> tag)
+		{
+			for (int i = 0; i < opt_victim; i++)
+				if (s.victim[i].line.valid && s.victim[i].line_index == s.line_index && s.victim[i].line.tag == tag)
+					return &s.victim[i];
+			return NULL;
+		}
+
+		// the next request the cache sent must be req at addr, returns its shared line
+		bool bus(int req, int addr)
+		{
+			if (next < log->size() && (*log)[next].req == req && (*log)[next].addr == addr)
+				return (*log)[next++].shared;
+			if (bus_error[0] == '\0')
+				sprintf(bus_error, "expected bus %s 0x%08x", bus_name(req), addr);
+			return false;
+		}
+
+		/*
+		 * Next line prefetch after a miss. Whether the next line was
+		 * already present is outside the set, so a missing prefetch is
+		 * accepted, one that is sent must be allowed.
+		 */
+		void prefetch(int addr)
+		{
+			int line = (addr & ~31) + 32;
+			if (next >= log->size() || (*log)[next].req != Cache::BUS_RD || (*log)[next].addr != line)
+				return;
+			if (config.prefetch != PREFETCH_NEXT || s.prefetching)
+				return;
+			s.prefetching = true;
+			s.prefetch_addr = line;
+			s.prefetch_shared = (*log)[next++].shared;
+			s.prefetch_snooped = false;
+		}
+
+		int victim_way(int actual)
+		{
+			if (config.policy == REPLACE_RANDOM)
+				return actual;
+			if (config.policy == REPLACE_PLRU){
+				// follow the tree away from the half used last
+				int node = 0, way = 0;
+				for (int half = config.ways / 2; half >= 1; half /= 2){
+					if (s.plru & (1 << (config.ways - 2 - node))){
+						way |= half;
+						node = 2 * node + 2;
+					}
+					else
+						node = 2 * node + 1;
+				}
+				return way;
+			}
+			int way = 0;
+			for (int i = 1; i < config.ways; i++)
+				if (s.stamp[i] < s.stamp[way])
+					way = i;
+			return way;
+		}
+
+		void touch(int way)
+		{
+			if (config.policy == REPLACE_LRU)
+				s.stamp[way] = ++s.use_clock;
+			else if (config.policy == REPLACE_PLRU){
+				int node = 0;
+				for (int half = config.ways / 2; half >= 1; half /= 2){
+					int bit = 1 << (config.ways - 2 - node);
+					if (way & half){
+						s.plru &= ~bit;
+						node = 2 * node + 2;
+					}
+					else{
+						s.plru |= bit;
+						node = 2 * node + 1;
+					}
+				}
+			}
+		}
+
+		int allocate(bool *evicted, int actual)
+		{
+			int way = -1;
+			for (int i = 0; i < config.ways && way < 0; i++)
+				if (!s.line[i].valid)
+					way = i;
+			*evicted = (way < 0);
+			if (way < 0)
+				way = victim_way(actual);
+			if (config.policy == REPLACE_FIFO)
+				s.stamp[way] = ++s.use_clock;
+			return way;
+		}
+
+		// a victim cache hit moves into the sets, the line it replaces takes the entry
+		int swap(aca_victim_line *v, int actual)
+		{
+			bool evicted;
+			int way = allocate(&evicted, actual);
+			aca_cache_line replaced = s.line[way];
+
+			s.line[way] = v -> line;
+			if (evicted){
+				v -> line = replaced;
+				v -> last_use = ++s.victim_clock;
+			}
+			else
+				v -> line.valid = false;
+			return way;
+		}
+
+		// room for a missing line, the replaced one goes to the victim cache
+		int new_line(int actual)
+		{
+			bool evicted;
+			int way = allocate(&evicted, actual);
+			aca_cache_line *l = &s.line[way];
+
+			if (evicted && s.reserved && s.reserve_line == line_addr(l -> tag))
+				s.reserved = false;
+			if (evicted && opt_victim){
+				aca_victim_line *v = NULL;
+				for (int i = 0; i < opt_victim && v == NULL; i++)
+					if (!s.victim[i].line.valid)
+						v = &s.victim[i];
+				if (v == NULL){
+					v = &s.victim[0];
+					for (int i = 1; i < opt_victim; i++)
+						if (s.victim[i].last_use < v -> last_use)
+							v = &s.victim[i];
+				}
+				v -> line = *l;
+				v -> line_index = s.line_index;
+				v -> last_use = ++s.victim_clock;
+			}
+			l -> valid = false;
+			l -> sector_valid = 0;
+			l -> sector_dirty = 0;
+			return way;
+		}
+
+		// the sector of addr arrives from memory
+		void fill(int way, int addr, int sector, const CheckSet &after)
+		{
+			aca_cache_line *l = &s.line[way];
+			for (int j = sector * opt_sector; j < (sector + 1) * opt_sector; j++)
+				l -> data[j] = after.line[way].data[j];
+			l -> sector_valid |= 1 << sector;
+			l -> valid = true;
+			l -> snooped = false;
+			l -> prefetched = false;
+			l -> tag = tag_of(addr);
+		}
+};
+
+/*
+ * Lockstep checker (--check): the golden model above next to
+ * Cache::execute and Cache::snoop. Every access, snoop and prefetch
+ * install is replayed on the set it started from. The outcome, the way
+ * used, the data returned, the bus requests sent, and the resulting set,
+ * replacement state, victim cache, reservation and prefetch in flight must
+ * all match. Every bus transaction must be snooped by all other caches,
+ * and its shared line must be what their golden models asserted. The
+ * first divergence prints the actual and expected set side by side, also
+ * to check.txt, and ends the run.
+ *
+ * An access waits for the bus and memory, and a replay in one step means
+ * nothing once a snoop changed its set, or the state outside the sets, in
+ * the meantime. Such accesses are counted as skipped, the snoop itself is
+ * still checked. A snoop that only marked the prefetch in flight stale is
+ * applied to the replay instead. Page walk references are not checked.
+ *
+ * Most snoops find nothing to change: the line is not in the set, the
+ * victim cache, the prefetcher or the reservation. Those are checked by
+ * comparing the set before and after, without a golden replay.
+ *
+ * The lock workloads return values from sync_memory, not from the lines.
+ * The checker keeps its own copy of it, updated by rules written again
+ * from the Atomic definitions, and every value read, every atomic result
+ * and every word an atomic leaves behind must match that copy.
+ */
+class Checker : public Check_if
+{
+	public:
+		long accesses;		// accesses checked
+		long skipped;		// accesses a snoop changed the state of while they ran
+		long snoops;
+		long installs;
+		long transactions;
+		long values;		// sync_memory reads and atomics checked
+
+		Checker(int caches) : accesses(0), skipped(0), snoops(0), installs(0), transactions(0), values(0),
+			log(caches), active(caches, false), raced(caches, false), prefetch_snooped(caches, false), index(caches, 0),
+			snoopers(0), expect_shared(false)
+		{
+		}
+
+		virtual void begin_access(int cache, unsigned int line_index)
+		{
+			log[cache].clear();
+			active[cache] = true;
+			raced[cache] = false;
+			prefetch_snooped[cache] = false;
+			index[cache] = line_index;
+		}
+
+		virtual void end_access(int cache, const CacheConfig &config, const CheckAccess &a,
+			const CheckSet &before, const CheckSet &after)
+		{
+			static const char *func_names[] = { "read", "write", "atomic" };
+			char event[64];
+			char what[128];
+
+			active[cache] = false;
+			if (raced[cache]){
+				skipped++;
+				return;
+			}
+			accesses++;
+			GoldenSet golden(config, before, &log[cache]);
+			golden.access(a, after);
+			if (prefetch_snooped[cache] && golden.s.prefetching)
+				golden.s.prefetch_snooped = true;
+
+			sprintf(event, "%s 0x%08x", func_names[a.func], a.addr);
+			if (golden.hit != a.hit || golden.outcome != a.outcome)
+				sprintf(what, "hit %d outcome %d, expected hit %d outcome %d", a.hit, a.outcome, golden.hit, golden.outcome);
+			else if (golden.set != a.set)
+				sprintf(what, "way %d, expected %d", a.set, golden.set);
+			else if (golden.returns && golden.returned != a.returned)
+				sprintf(what, "returned %d, expected %d", a.returned, golden.returned);
+			else if (golden.bus_error[0] != '\0')
+				strcpy(what, golden.bus_error);
+			else if (compare(config, golden.s, after, true) != NULL)
+				strcpy(what, compare(config, golden.s, after, true));
+			else
+				return;
+			diverge(cache, config, event, what, &golden.s, &after);
+		}
+
+		virtual void snoop(int cache, const CacheConfig &config, int req, int addr, int data,
+			const CheckSet &before, const CheckSet &after)
+		{
+			char event[64];
+
+			snoops++;
+			snoopers++;
+			if (!snoop_finds(config, before, addr)){
+				// nothing for the snoop to change, the set must be as it was
+				if (compare(config, before, after, true) != NULL){
+					sprintf(event, "snooped %s 0x%08x", GoldenSet::bus_name(req), addr);
+					diverge(cache, config, event, compare(config, before, after, true), &before, &after);
+				}
+				return;
+			}
+			GoldenSet golden(config, before, NULL);
+			golden.snoop(req, addr, data);
+			if (golden.asserts_shared)
+				expect_shared = true;
+			if (compare(config, golden.s, after, true) != NULL){
+				sprintf(event, "snooped %s 0x%08x", GoldenSet::bus_name(req), addr);
+				diverge(cache, config, event, compare(config, golden.s, after, true), &golden.s, &after);
+			}
+			if (!active[cache] || compare(config, before, after, before.line_index == index[cache]) == NULL)
+				return;
+			// a prefetch going stale is the one change the replay can take over
+			CheckSet unmarked(after);
+			unmarked.prefetch_snooped = before.prefetch_snooped;
+			if (compare(config, before, unmarked, before.line_index == index[cache]) == NULL)
+				prefetch_snooped[cache] = true;
+			else
+				raced[cache] = true;
+		}
+
+		virtual void install(int cache, const CacheConfig &config, int set,
+			const CheckSet &before, const CheckSet &after)
+		{
+			char event[64];
+
+			installs++;
+			GoldenSet golden(config, before, NULL);
+			golden.install(set, after);
+			if (compare(config, golden.s, after, true) != NULL){
+				sprintf(event, "prefetch install 0x%08x", before.prefetch_addr);
+				diverge(cache, config, event, compare(config, golden.s, after, true), &golden.s, &after);
+			}
+		}
+
+		virtual void bus_begin()
+		{
+			snoopers = 0;
+			expect_shared = false;
+		}
+
+		virtual void bus_end(int writer, int addr, int req, bool shared)
+		{
+			char event[64];
+			char what[128];
+
+			transactions++;
+			sprintf(event, "bus %s 0x%08x", GoldenSet::bus_name(req), addr);
+			if (snoopers != (int)log.size() - 1){
+				sprintf(what, "snooped by %d caches, expected %d", snoopers, (int)log.size() - 1);
+				diverge(writer, CacheConfig(), event, what, NULL, NULL);
+			}
+			if (shared != expect_shared){
+				sprintf(what, "shared line %d, expected %d", shared, expect_shared);
+				diverge(writer, CacheConfig(), event, what, NULL, NULL);
+			}
+			CheckBus b = { req, addr, shared };
+			log[writer].push_back(b);
+		}
+
+		virtual void sync_read(int cache, int addr, int value)
+		{
+			char event[64];
+			char what[128];
+
+			values++;
+			if (value != memory[addr]){
+				sprintf(event, "read of sync memory 0x%08x", addr);
+				sprintf(what, "returned %d, expected %d", value, memory[addr]);
+				diverge(cache, CacheConfig(), event, what, NULL, NULL);
+			}
+		}
+
+		virtual void sync_write(int cache, int addr, int value)
+		{
+			memory[addr] = value;
+		}
+
+		virtual void sync_atomic(int cache, int atomic, int addr, int operand, int expected, int result, int stored)
+		{
+			static const char *atomic_names[] = { "none", "TAS", "FAA", "CAS", "LL", "SC" };
+			char event[64];
+			char what[128];
+			int &word = memory[addr];
+			int old = word;
+			int returns = old;
+
+			values++;
+			if (atomic == ATOMIC_TAS)
+				word = 1;
+			else if (atomic == ATOMIC_FAA)
+				word = old + operand;
+			else if (atomic == ATOMIC_CAS)
+				word = (old == expected) ? operand : old;
+			else if (atomic == ATOMIC_SC){
+				// only a store-conditional that kept its reservation gets here
+				word = operand;
+				returns = 1;
+			}
+			sprintf(event, "%s of sync memory 0x%08x", atomic_names[atomic], addr);
+			if (result != returns){
+				sprintf(what, "returned %d, expected %d", result, returns);
+				diverge(cache, CacheConfig(), event, what, NULL, NULL);
+			}
+			if (stored != word){
+				sprintf(what, "left %d, expected %d", stored, word);
+				diverge(cache, CacheConfig(), event, what, NULL, NULL);
+			}
+		}
+
+	private:
+		vector<vector<CheckBus> > log;	// per cache, bus requests of the current access
+		vector<bool> active;		// per cache, an access is between begin and end
+		vector<bool> raced;		// per cache, a snoop changed its state during the access
+		vector<bool> prefetch_snooped;	// per cache, a snoop only marked its prefetch in flight during the access
+		vector<unsigned int> index;	// per cache, line index of the access
+		int snoopers;			// caches that snooped the current transaction
+		bool expect_shared;
+		unordered_map<uint32_t, int> memory;	// golden copy of sync_memory
+
+		// whether a snoop of addr has anything in the set to change
+		static bool snoop_finds(const CacheConfig &config, const CheckSet &s, int addr)
+		{
+			unsigned int tag = (unsigned int)addr >> (5 + __builtin_ctz(config.size / 32 / config.ways));
+
+			if ((s.prefetching && (addr & ~31) == s.prefetch_addr) || (s.reserved && s.reserve_line == (addr & ~31)))
+				return true;
+			for (int i = 0; i < config.ways; i++)
+				if (s.line[i].valid && s.line[i].tag == tag)
+					return true;
+			for (int i = 0; i < opt_victim; i++)
+				if (s.victim[i].line.valid && s.victim[i].line_index == s.line_index && s.victim[i].line.tag == tag)
+					return true;
+			return false;
+		}
+
+		static bool same_line(const aca_cache_line &a, const aca_cache_line &b)
+		{
+			if (a.valid != b.valid || a.snooped != b.snooped || a.shared != b.shared || a.prefetched != b.prefetched
+				|| a.sector_valid != b.sector_valid || a.sector_dirty != b.sector_dirty || a.tag != b.tag)
+				return false;
+			for (int j = 0; j < 8; j++)
+				if (a.data[j] != b.data[j])
+					return false;
+			return true;
+		}
+
+		// what differs between a and b, NULL if nothing; the sets only when sets is true
+		static const char *compare(const CacheConfig &config, const CheckSet &a, const CheckSet &b, bool sets)
+		{
+			for (int i = 0; sets && i < config.ways; i++)
+				if (!same_line(a.line[i], b.line[i]))
+					return "set contents";
+			for (int i = 0; sets && i < config.ways; i++)
+				if (a.stamp[i] != b.stamp[i])
+					return "replacement state";
+			if ((sets && a.plru != b.plru) || a.use_clock != b.use_clock)
+				return "replacement state";
+			for (int i = 0; i < opt_victim; i++)
+				if (!same_line(a.victim[i].line, b.victim[i].line) || a.victim[i].line_index != b.victim[i].line_index
+					|| a.victim[i].last_use != b.victim[i].last_use)
+					return "victim cache";
+			if (a.victim_clock != b.victim_clock)
+				return "victim cache";
+			if (a.reserved != b.reserved || (a.reserved && a.reserve_line != b.reserve_line))
+				return "reservation";
+			if (a.prefetching != b.prefetching || (a.prefetching && (a.prefetch_addr != b.prefetch_addr
+				|| a.prefetch_shared != b.prefetch_shared || a.prefetch_snooped != b.prefetch_snooped)))
+				return "prefetch in flight";
+			return NULL;
+		}
+
+		static void emit(FILE *f, const char *line)
+		{
+			fputs(line, stderr);
+			if (f != NULL)
+				fputs(line, f);
+		}
+
+		static void print_line(FILE *f, const char *name, const aca_cache_line &a, const aca_cache_line &e,
+			unsigned long a_stamp, unsigned long e_stamp)
+		{
+			char line[256];
+			bool same = same_line(a, e) && a_stamp == e_stamp;
+
+			sprintf(line, "%s%s\t%d\t%05x\t%02x\t%02x\t%d\t%d\t%lu\t| %d\t%05x\t%02x\t%02x\t%d\t%d\t%lu\n",
+				same ? " " : "*", name, a.valid, (unsigned int)a.tag, a.sector_valid, a.sector_dirty, a.shared, a.snooped, a_stamp,
+				e.valid, (unsigned int)e.tag, e.sector_valid, e.sector_dirty, e.shared, e.snooped, e_stamp);
+			emit(f, line);
+			for (int j = 0; j < 8; j++)
+				if (a.data[j] != e.data[j]){
+					sprintf(line, " \tword %d: %d | %d\n", j, a.data[j], e.data[j]);
+					emit(f, line);
+				}
+		}
+
+		// print the actual and expected set, then stop the run
+		void diverge(int cache, const CacheConfig &config, const char *event, const char *what,
+			const CheckSet *expected, const CheckSet *actual)
+		{
+			FILE *f = fopen("check.txt", "w");
+			char line[256];
+			char name[16];
+
+			sprintf(line, "Divergence in cache %d at cycle %ld, %s: %s\n", cache, now_cycles(), event, what);
+			emit(f, line);
+			if (expected != NULL){
+				sprintf(line, "line index %u, actual | expected\n", actual->line_index);
+				emit(f, line);
+				sprintf(line, " way\tvalid\ttag\tsectors\tdirty\tshared\tsnooped\tstamp\t| valid\ttag\tsectors\tdirty\tshared\tsnooped\tstamp\n");
+				emit(f, line);
+				for (int i = 0; i < config.ways; i++){
+					sprintf(name, "%d", i);
+					print_line(f, name, actual->line[i], expected->line[i], actual->stamp[i], expected->stamp[i]);
+				}
+				sprintf(line, "%slru\t%04x\t| %04x\n", actual->plru != expected->plru ? "*" : " ", actual->plru, expected->plru);
+				emit(f, line);
+				for (int i = 0; i < opt_victim; i++){
+					sprintf(name, "v%d", i);
+					if (!same_line(actual->victim[i].line, expected->victim[i].line) || actual->victim[i].last_use != expected->victim[i].last_use)
+						print_line(f, name, actual->victim[i].line, expected->victim[i].line,
+							actual->victim[i].last_use, expected->victim[i].last_use);
+				}
+				if (compare(config, *expected, *actual, false) != NULL){
+					sprintf(line, " reservation %d 0x%08x | %d 0x%08x, prefetch %d 0x%08x | %d 0x%08x\n",
+						actual->reserved, actual->reserve_line, expected->reserved, expected->reserve_line,
+						actual->prefetching, actual->prefetch_addr, expected->prefetching, expected->prefetch_addr);
+					emit(f, line);
+				}
+			}
+			if (f != NULL)
+				fclose(f);
+			exit(1);
+		}
+};
+
+/* What the lock workloads add to a TraceFile entry */
+struct SyncOp
+{
+	int atomic;	// enum Atomic, ATOMIC_NONE for a plain read or write
+	int data;	// value written, added or stored conditionally
+	int expected;	// compare value of ATOMIC_CAS
+};
+
+/*
+ * Where CPU::execute gets its accesses from: the tracefile, or one of the
+ * synthetic generators below (--synth=KIND). Like TraceFile, eof() is
+ * global and next() hands out one entry for the given CPU. Sources that
+ * depend on the values they read (the lock workloads) also supply the
+ * operands of each entry and get told what it returned.
+ */
+class TraceSource
+{
+	public:
+		virtual ~TraceSource() {}
+		virtual bool next(int cpu, TraceFile::Entry &e) = 0;
+		virtual bool eof() = 0;
+		// operands of the entry next() just returned, false if the source has none
+		virtual bool sync(int cpu, SyncOp &op) { return false; }
+		// value the entry returned, 0 for plain writes
+		virtual void complete(int cpu, int value) {}
+};
+
+class FileTraceSource : public TraceSource
+{
+	public:
+		bool next(int cpu, TraceFile::Entry &e) { return tracefile_ptr->next(cpu, e); }
+		bool eof() { return tracefile_ptr->eof(); }
+};
+
+/* A tracefile read into memory once, one stream of entries per CPU */
+struct LoadedTrace
+{
+	vector< vector<TraceFile::Entry> > streams;
+};
+
+/* Replays a LoadedTrace. CPUs at the end of their stream get NOPs until all are */
+class ReplayTraceSource : public TraceSource
+{
+	public:
+		ReplayTraceSource(const vector< vector<TraceFile::Entry> > *streams)
+			: streams(streams), pos(streams->size(), 0), done(0)
+		{
+			for (size_t i = 0; i < streams->size(); i++)
+				if ((*streams)[i].empty())
+					done++;
+		}
+
+		bool next(int cpu, TraceFile::Entry &e)
+		{
+			const vector<TraceFile::Entry> &s = (*streams)[cpu];
+			if (pos[cpu] >= s.size())
+			{
+				e.type = TraceFile::ENTRY_TYPE_NOP;
+				e.addr = 0;
+				return true;
+			}
+			e = s[pos[cpu]++];
+			if (pos[cpu] == s.size())
+				done++;
+			return true;
+		}
+
+		bool eof() { return done == streams->size(); }
+
+	private:
+		const vector< vector<TraceFile::Entry> > *streams;
+		vector<size_t> pos;
+		size_t done;
+};
+
+TraceSource *trace_source = NULL;
+
+/*
+ * Set while a CPU that read ahead over NOPs took the last entry of the
+ * trace before the cycle it would have been read in, see CPU::skip_nops.
+ */
+bool eof_held = false;
+
+/*
+ * Longest NOP run CPU::skip_nops sleeps through at once. A CPU past the
+ * end of its own stream reads NOPs until every CPU is done, and reading
+ * ahead never yields, so an unbounded run would keep the others from
+ * ever getting there.
+ */
+#define NOP_RUN_MAX 1024
+
+static inline bool trace_eof()
+{
+	return trace_source->eof() && !eof_held;
+}
+
+/*
+ * Parametric workloads, generated on the fly with a private random stream
+ * per CPU (seeded from --seed and the CPU id), so results do not depend on
+ * the order the CPUs ask for entries:
+ *
+ *   stride      private region per CPU, walked with --stride
+ *   random      uniform words in a private region per CPU
+ *   prodcons    even CPUs write a buffer that the next odd CPU reads
+ *   migratory   read-modify-write of shared objects handed from CPU to CPU
+ *   falseshare  every CPU uses its own word of the same 32-byte lines
+ *   zipf        shared hot set, lines picked with Zipf(--zipf) popularity
+ *
+ * The working set of each region is --wss bytes, every CPU issues
+ * --accesses entries, --write-ratio percent of them writes and --nop
+ * percent of them NOPs.
+ */
+class SyntheticSource : public TraceSource
+{
+	public:
+		SyntheticSource(SynthKind k, unsigned int cpus, long accesses, unsigned int wss,
+			unsigned long seed, int write_ratio, int nop_ratio, unsigned int stride, double alpha)
+			: kind(k), per_cpu(accesses), wss(wss < 32 ? 32 : wss & ~31u),
+			  write_ratio(write_ratio), nop_ratio(nop_ratio), stride(stride), done(0)
+		{
+			issued.assign(cpus, 0);
+			for (unsigned int i = 0; i < cpus; i++)
+				rng.push_back(splitmix(seed * 0x9E3779B97F4A7C15UL + i + 1));
+
+			if (kind == SYNTH_ZIPF)
+			{
+				unsigned int lines = this->wss / 32;
+				double sum = 0;
+				zipf_cdf.resize(lines);
+				for (unsigned int r = 0; r < lines; r++)
+				{
+					sum += 1.0 / pow(r + 1, alpha);
+					zipf_cdf[r] = sum;
+				}
+				for (unsigned int r = 0; r < lines; r++)
+					zipf_cdf[r] /= sum;
+			}
+		}
+
+		bool eof() { return done == issued.size(); }
+
+		bool next(int cpu, TraceFile::Entry &e)
+		{
+			long i = issued[cpu];
+			e.type = TraceFile::ENTRY_TYPE_NOP;
+			e.addr = 0;
+			if (i >= per_cpu)
+				return true;
+			if (++issued[cpu] == per_cpu)
+				done++;
+
+			if (nop_ratio && (int)(random(cpu) % 100) < nop_ratio)
+				return true;
+			bool write = (int)(random(cpu) % 100) < write_ratio;
+			unsigned int region = cpu * wss;
+			unsigned int lines = wss / 32;
+
+			switch (kind)
+			{
+				case SYNTH_STRIDE:
+					e.addr = region + (unsigned int)((i * stride) % wss);
+					break;
+				case SYNTH_RANDOM:
+					e.addr = region + (random(cpu) % (wss / 4)) * 4;
+					break;
+				case SYNTH_PRODCONS:
+					e.addr = (cpu / 2) * wss + (unsigned int)((i * 4) % wss);
+					write = (cpu % 2 == 0);
+					break;
+				case SYNTH_MIGRATORY:
+					// read then write each object, CPU c works one object ahead of c+1
+					e.addr = (unsigned int)(((i / 2) + lines - (cpu % lines)) % lines) * 32;
+					write = (i % 2 == 1);
+					break;
+				case SYNTH_FALSESHARE:
+					e.addr = (unsigned int)(i % lines) * 32 + (cpu % 8) * 4;
+					break;
+				case SYNTH_ZIPF:
+				{
+					double u = (random(cpu) >> 11) * (1.0 / 9007199254740992.0);
+					unsigned int line = lower_bound(zipf_cdf.begin(), zipf_cdf.end(), u) - zipf_cdf.begin();
+					e.addr = min(line, lines - 1) * 32 + (random(cpu) % 8) * 4;
+					break;
+				}
+				default:
+					break;
+			}
+			e.type = write ? TraceFile::ENTRY_TYPE_WRITE : TraceFile::ENTRY_TYPE_READ;
+			return true;
+		}
+
+	private:
+		SynthKind kind;
+		long per_cpu;
+		unsigned int wss;
+		int write_ratio;
+		int nop_ratio;
+		unsigned int stride;
+		size_t done;
+		vector<long> issued;
+		vector<unsigned long> rng;
+		vector<double> zipf_cdf;
+
+		static unsigned long splitmix(unsigned long x)
+		{
+			x += 0x9E3779B97F4A7C15UL;
+			x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9UL;
+			x = (x ^ (x >> 27)) * 0x94D049BB133111EBUL;
+			return x ^ (x >> 31);
+		}
+
+		// xorshift64* per CPU
+		unsigned long random(int cpu)
+		{
+			unsigned long x = rng[cpu];
+			x ^= x >> 12;
+			x ^= x << 25;
+			x ^= x >> 27;
+			rng[cpu] = x;
+			return x * 0x2545F4914F6CDD1DUL;
+		}
+};
+
+/*
+ * Lock workloads (--synth=spinlock|ticket|mcs). Every CPU runs --accesses
+ * critical sections, each a read and write of a shared counter, guarded by
+ *
+ *   spinlock    test-and-test-and-set on one flag
+ *   ticket      fetch-and-add on the next ticket, spin on the now serving word
+ *   mcs         MCS queue lock, the tail swapped in with LL/SC, every CPU
+ *               spinning on the flag of its own queue node
+ *
+ * Each entry depends on what the previous one of the CPU returned, so the
+ * source is a state machine per CPU driven by complete(). Values live in
+ * sync_memory. Lock handoff latency is the time from a holder issuing its
+ * release to the next holder owning the lock, counted when the next holder
+ * was already waiting.
+ */
+#define LOCK_WORD	0x0000	// spinlock flag, next ticket or MCS tail
+#define LOCK_SERVING	0x0020	// ticket now serving
+#define LOCK_COUNTER	0x0040	// data of the critical section
+#define LOCK_QNODE	0x1000	// MCS queue node of CPU c: locked at +64c, next at +64c+32
+
+class LockSource : public TraceSource
+{
+	public:
+		enum State
+		{
+			SPIN_READ,	// spinlock
+			SPIN_TAS,
+			SPIN_RELEASE,
+			TICKET_TAKE,	// ticket lock
+			TICKET_WAIT,
+			TICKET_RELEASE,
+			MCS_INIT_NEXT,	// MCS lock
+			MCS_INIT_LOCKED,
+			MCS_LL,
+			MCS_SC,
+			MCS_LINK,
+			MCS_SPIN,
+			MCS_READ_NEXT,
+			MCS_CAS,
+			MCS_WAIT_NEXT,
+			MCS_HANDOFF,
+			CS_READ,	// critical section
+			CS_WRITE,
+			LOCK_DONE
+		};
+
+		LockSource(SynthKind k, unsigned int cpus, long sections)
+			: kind(k), per_cpu(sections), done(0), last_release(-1), failed(0)
+		{
+			cpu.resize(cpus);
+			for (unsigned int i = 0; i < cpus; i++)
+				start(i);
+		}
+
+		bool eof() { return done == cpu.size(); }
+
+		bool next(int c, TraceFile::Entry &e)
+		{
+			LockCpu &p = cpu[c];
+			SyncOp &op = p.op;
+
+			op.atomic = ATOMIC_NONE;
+			op.data = 0;
+			op.expected = 0;
+			e.type = TraceFile::ENTRY_TYPE_READ;
+			if (p.state == first_acquire() && p.wait_start < 0)
+				p.wait_start = now_cycles();
+			if (p.state == first_release())
+				last_release = now_cycles();
+
+			switch (p.state)
+			{
+				case SPIN_READ:
+				case TICKET_WAIT:
+					e.addr = (p.state == SPIN_READ) ? LOCK_WORD : LOCK_SERVING;
+					break;
+				case SPIN_TAS:
+					e.addr = LOCK_WORD;
+					op.atomic = ATOMIC_TAS;
+					break;
+				case SPIN_RELEASE:
+					store(e, op, LOCK_WORD, 0);
+					break;
+				case TICKET_TAKE:
+					e.addr = LOCK_WORD;
+					op.atomic = ATOMIC_FAA;
+					op.data = 1;
+					break;
+				case TICKET_RELEASE:
+					store(e, op, LOCK_SERVING, p.ticket + 1);
+					break;
+				case MCS_INIT_NEXT:
+					store(e, op, qnode_next(c), 0);
+					break;
+				case MCS_INIT_LOCKED:
+					store(e, op, qnode_locked(c), 1);
+					break;
+				case MCS_LL:
+					e.addr = LOCK_WORD;
+					op.atomic = ATOMIC_LL;
+					break;
+				case MCS_SC:
+					e.addr = LOCK_WORD;
+					op.atomic = ATOMIC_SC;
+					op.data = c + 1;
+					break;
+				case MCS_LINK:
+					store(e, op, qnode_next(p.other - 1), c + 1);
+					break;
+				case MCS_SPIN:
+					e.addr = qnode_locked(c);
+					break;
+				case MCS_READ_NEXT:
+				case MCS_WAIT_NEXT:
+					e.addr = qnode_next(c);
+					break;
+				case MCS_CAS:
+					e.addr = LOCK_WORD;
+					op.atomic = ATOMIC_CAS;
+					op.data = 0;
+					op.expected = c + 1;
+					break;
+				case MCS_HANDOFF:
+					store(e, op, qnode_locked(p.other - 1), 0);
+					break;
+				case CS_READ:
+					e.addr = LOCK_COUNTER;
+					break;
+				case CS_WRITE:
+					store(e, op, LOCK_COUNTER, p.counter + 1);
+					break;
+				case LOCK_DONE:
+					e.type = TraceFile::ENTRY_TYPE_NOP;
+					e.addr = 0;
+					break;
+			}
+			if (op.atomic != ATOMIC_NONE)
+				e.type = TraceFile::ENTRY_TYPE_WRITE;
+			return true;
+		}
+
+		bool sync(int c, SyncOp &op)
+		{
+			op = cpu[c].op;
+			return true;
+		}
+
+		void complete(int c, int value)
+		{
+			LockCpu &p = cpu[c];
+
+			switch (p.state)
+			{
+				case SPIN_READ:
+					if (value == 0)
+						p.state = SPIN_TAS;
+					break;
+				case SPIN_TAS:
+					if (value == 0)
+						acquired(c);
+					else{
+						failed++;
+						p.state = SPIN_READ;
+					}
+					break;
+				case TICKET_TAKE:
+					p.ticket = value;
+					p.state = TICKET_WAIT;
+					break;
+				case TICKET_WAIT:
+					if (value == p.ticket)
+						acquired(c);
+					break;
+				case MCS_INIT_NEXT:
+					p.state = MCS_INIT_LOCKED;
+					break;
+				case MCS_INIT_LOCKED:
+					p.state = MCS_LL;
+					break;
+				case MCS_LL:
+					p.other = value; // predecessor
+					p.state = MCS_SC;
+					break;
+				case MCS_SC:
+					if (value == 0){
+						failed++;
+						p.state = MCS_LL;
+					}
+					else if (p.other == 0)
+						acquired(c);
+					else
+						p.state = MCS_LINK;
+					break;
+				case MCS_LINK:
+					p.state = MCS_SPIN;
+					break;
+				case MCS_SPIN:
+					if (value == 0)
+						acquired(c);
+					break;
+				case MCS_READ_NEXT:
+				case MCS_WAIT_NEXT:
+					if (value != 0){
+						p.other = value; // successor
+						p.state = MCS_HANDOFF;
+					}
+					else if (p.state == MCS_READ_NEXT)
+						p.state = MCS_CAS;
+					break;
+				case MCS_CAS:
+					if (value == c + 1)
+						released(c);
+					else{
+						failed++;
+						p.state = MCS_WAIT_NEXT;
+					}
+					break;
+				case CS_READ:
+					p.counter = value;
+					p.state = CS_WRITE;
+					break;
+				case CS_WRITE:
+					p.state = first_release();
+					break;
+				case SPIN_RELEASE:
+				case TICKET_RELEASE:
+				case MCS_HANDOFF:
+					released(c);
+					break;
+				case LOCK_DONE:
+					break;
+			}
+		}
+
+		// acquisitions, handoffs to a waiting CPU, and acquire latencies
+		long acquisitions() const { return acquire.count; }
+		const LatencyHistogram &handoffs() const { return handoff; }
+		const LatencyHistogram &acquire_latency() const { return acquire; }
+		// TAS, SC and CAS attempts that did not get what they wanted
+		long failed_attempts() const { return failed; }
+		// the shared counter, cpus * sections if the lock excluded
+		int counter() { return sync_memory[LOCK_COUNTER]; }
+		long expected_counter() const { return (long)cpu.size() * per_cpu; }
+
+	private:
+		struct LockCpu
+		{
+			State state;
+			SyncOp op;	// operands of the last entry
+			long sections;
+			long wait_start;
+			int ticket;
+			int other;	// MCS predecessor or successor, CPU id + 1
+			int counter;
+		};
+
+		SynthKind kind;
+		long per_cpu;
+		size_t done;
+		long last_release;
+		long failed;
+		vector<LockCpu> cpu;
+		LatencyHistogram handoff;
+		LatencyHistogram acquire;
+
+		static uint32_t qnode_locked(int c) { return LOCK_QNODE + c * 64; }
+		static uint32_t qnode_next(int c) { return LOCK_QNODE + c * 64 + 32; }
+
+		static void store(TraceFile::Entry &e, SyncOp &op, uint32_t addr, int value)
+		{
+			e.type = TraceFile::ENTRY_TYPE_WRITE;
+			e.addr = addr;
+			op.data = value;
+		}
+
+		State first_acquire() const
+		{
+			return kind == SYNTH_SPINLOCK ? SPIN_READ : kind == SYNTH_TICKET ? TICKET_TAKE : MCS_INIT_NEXT;
+		}
+
+		State first_release() const
+		{
+			return kind == SYNTH_SPINLOCK ? SPIN_RELEASE : kind == SYNTH_TICKET ? TICKET_RELEASE : MCS_READ_NEXT;
+		}
+
+		void start(int c)
+		{
+			cpu[c].state = first_acquire();
+			cpu[c].sections = 0;
+			cpu[c].wait_start = -1;
+			cpu[c].ticket = 0;
+			cpu[c].other = 0;
+			cpu[c].counter = 0;
+		}
+
+		void acquired(int c)
+		{
+			LockCpu &p = cpu[c];
+			long now = now_cycles();
+
+			acquire.record(now - p.wait_start);
+			if (last_release >= p.wait_start)
+				handoff.record(now - last_release);
+			p.wait_start = -1;
+			p.state = CS_READ;
+		}
+
+		void released(int c)
+		{
+			LockCpu &p = cpu[c];
+
+			if (++p.sections == per_cpu){
+				p.state = LOCK_DONE;
+				done++;
+			}
+			else
+				p.state = first_acquire();
+		}
+};
+
+SC_MODULE(CPU) 
+{
+
+	public:
+		sc_in<bool>                Port_CLK;
+		sc_in<Cache::RetCode>   Port_MemDone;
+		sc_out<Cache::Function> Port_MemFunc;
+		sc_out<int>                Port_MemAddr;
+		sc_inout_rv<32>            Port_MemData;
+		sc_in<int>                 Port_MemOutcome;
+		sc_out<int>                Port_MemAtomic;
+		sc_out<int>                Port_MemExpected;
+		int cpu_id;
+
+		// request to done, in cycles, by [Function][Cache::Outcome]
+		LatencyHistogram latency[3][3];
+
+		SC_CTOR(CPU) 
+		{
+			SC_THREAD(execute);
+			sensitive << Port_CLK.pos();
+			dont_initialize();
+		}
+
+	private:
+		// while another CPU holds back eof this one has only NOPs left
+		bool next_entry(TraceFile::Entry &e)
+		{
+			if (eof_held && trace_source->eof()){
+				e.type = TraceFile::ENTRY_TYPE_NOP;
+				e.addr = 0;
+				return true;
+			}
+			return trace_source->next(cpu_id, e);
+		}
+
+		/*
+		 * Coalesce a run of NOPs into one wait. Reads ahead while the
+		 * entry is a NOP, each read standing for the cycle the NOP would
+		 * have been waited in, and sleeps until the entry after the run is
+		 * due. If reading ahead takes the last entry of the trace, eof stays
+		 * hidden from the other CPUs until that cycle, so the simulation
+		 * stops at the same time as with one wait() per NOP.
+		 */
+		bool skip_nops(TraceFile::Entry &tr_data)
+		{
+			long skip = 0;
+			bool took_last = false;
+
+			while (tr_data.type == TraceFile::ENTRY_TYPE_NOP && !trace_source->eof() && skip < NOP_RUN_MAX)
+			{
+				if (!trace_source->next(cpu_id, tr_data))
+					return false;
+				skip++;
+				if (trace_source->eof()){
+					took_last = true;
+					eof_held = true;
+				}
+			}
+			if (skip == 0)
+				return true;
+
+			cout << sc_time_stamp() << ": CPU executes " << skip << " NOPs" << endl;
+			wait_cycles(skip);
+			if (took_last)
+				eof_held = false;
+			return true;
+		}
+
+		void execute() 
+		{
+			TraceFile::Entry    tr_data;
+			Cache::Function  f;
+			SyncOp           op;
+
+			// Loop until end of tracefile
+			while(!trace_eof())
+			{
+				// Get the next action for the processor in the trace, and
+				// sleep through a run of NOPs up to the entry after it
+				if(!next_entry(tr_data) || !skip_nops(tr_data))
+				{
+					cerr << "Error reading trace for CPU" << endl;
+					break;
+				}
+
+				// To demonstrate the statistic functions, we generate a 50%
+				// probability of a 'hit' or 'miss', and call the statistic
+				// functions below
+				//int j = rand()%2;
+
+				switch(tr_data.type)
+				{
+					case TraceFile::ENTRY_TYPE_READ:
+						f = Cache::FUNC_READ;
+						/*
+						   if(j)
+						   stats_readhit(0);
+						   else
+						   stats_readmiss(0);
+						 */
+						break;
+
+					case TraceFile::ENTRY_TYPE_WRITE:
+						f = Cache::FUNC_WRITE;
+						/*
+						   if(j)
+						   stats_writehit(0);
+						   else
+						   stats_writemiss(0);
+						 */						
+						break;
+
+					case TraceFile::ENTRY_TYPE_NOP:
+						break;
+
+					default:
+						cerr << "Error, got invalid data from Trace" << endl;
+						exit(0);
+				}
+
+				if(tr_data.type != TraceFile::ENTRY_TYPE_NOP)
+				{
+					// operands of the lock workloads, random data otherwise
+					bool sync = trace_source->sync(cpu_id, op);
+					if (!sync)
+						op.atomic = ATOMIC_NONE;
+					if (op.atomic != ATOMIC_NONE){
+						f = Cache::FUNC_ATOMIC;
+						Port_MemAtomic.write(op.atomic);
+						Port_MemExpected.write(op.expected);
+					}
+
+					sim_accesses++;
+					Port_MemAddr.write(tr_data.addr);
+
+					long issued = now_cycles();
+					Port_MemFunc.write(f);
+					// load-linked is a read, the other atomics send their operand like a write
+					if (f == Cache::FUNC_WRITE || (f == Cache::FUNC_ATOMIC && op.atomic != ATOMIC_LL)) 
+					{
+						cout << sc_time_stamp() << ": CPU "<<cpu_id<<" sends write" << endl;
+
+						uint32_t data = sync ? op.data : rand();
+						Port_MemData.write(data);
+						wait(); //this waiting for 1 cycle is mapping to the one cycle wait in the cache write hit.
+						Port_MemData.write("ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ");
+					}
+					else
+					{
+						cout << sc_time_stamp() << ": CPU  "<<cpu_id<<"sends read" << endl;
+					}
+					//cout <<"CPU: "<<"waiting for cache response" <<endl;
+					wait(Port_MemDone.value_changed_event());
+					//cout <<"CPU: "<<"get cache response" <<endl;
+					latency[f][Port_MemOutcome.read()].record(now_cycles() - issued);
+					if (sync)
+						trace_source->complete(cpu_id, f == Cache::FUNC_WRITE ? 0 : Port_MemData.read().to_int());
+
+					if (f == Cache::FUNC_READ)
+					{
+						cout << sc_time_stamp() << ": CPU reads: " << Port_MemData.read() << endl;
+					}
+				}
+				else
+				{
+					cout << sc_time_stamp() << ": CPU executes NOP" << endl;
+				}
+				// Advance one cycle in simulated time            
+				wait();
+			}
+
+			// Finished the Tracefile, now stop the simulation
+			sc_stop();
+		}
+};
+
+/*
+ * Waveform tracing (--trace=GROUPS). Replaces the sc_trace based VCD file
+ * that used to dump every signal for the whole run. Only the selected
+ * groups are written, only inside the cycle window, optionally starting
+ * when an address shows up on the bus, and optionally gzip compressed.
+ * All signals of the model change at a rising clock edge, so they are
+ * sampled at the falling edge and stamped with the rising one.
+ */
+class TraceProbe
+{
+	public:
+		virtual ~TraceProbe() {}
+		virtual string value() = 0;
+
+		string name;
+		string id;
+		int width;
+		string last;
+};
+
+template <class T>
+class SignalProbe : public TraceProbe
+{
+	public:
+		SignalProbe(const sc_signal<T> *s, int w) : sig(s) { width = w; }
+
+		string value()
+		{
+			unsigned long v = (unsigned long)sig->read();
+			if (width == 1)
+				return v ? "1" : "0";
+			string bits(width, '0');
+			for (int i = 0; i < width; i++)
+				if (v & (1UL << i))
+					bits[width-1-i] = '1';
+			return bits;
+		}
+
+	private:
+		const sc_signal<T> *sig;
+};
+
+class ResolvedProbe : public TraceProbe
+{
+	public:
+		ResolvedProbe(const sc_signal_rv<32> *s) : sig(s) { width = 32; }
+
+		string value()
+		{
+			string bits = sig->read().to_string();
+			for (size_t i = 0; i < bits.size(); i++)
+				bits[i] = tolower(bits[i]);
+			return bits;
+		}
+
+	private:
+		const sc_signal_rv<32> *sig;
+};
+
+SC_MODULE(Tracer)
+{
+	public:
+		sc_in<bool> Port_CLK;
+
+		long start;		// first traced cycle
+		long stop;		// last traced cycle, -1 for the end of the run
+		bool trigger;		// wait for trigger_addr on the bus first
+		unsigned int trigger_addr;
+		const sc_signal_rv<32> *bus_addr;
+		bool trace_clock;
+		sc_time period;
+
+		SC_CTOR(Tracer)
+		{
+			SC_METHOD(sample);
+			sensitive << Port_CLK.neg();
+			dont_initialize();
+
+			start = 0;
+			stop = -1;
+			trigger = false;
+			trigger_addr = 0;
+			bus_addr = NULL;
+			trace_clock = false;
+			file = NULL;
+			gzip_pid = -1;
+			dumping = false;
+			finished = false;
+		}
+
+		~Tracer()
+		{
+			close();
+			for (size_t i = 0; i < probes.size(); i++)
+				delete probes[i];
+		}
+
+		void add(TraceProbe *probe, const char *name)
+		{
+			probe->name = name;
+			probes.push_back(probe);
+		}
+
+		bool open(const char *name, bool gz)
+		{
+			char path[512];
+
+			if (snprintf(path, sizeof(path), gz ? "%s.vcd.gz" : "%s.vcd", name) >= (int)sizeof(path))
+				return false;
+			// gtkwave reads .vcd.gz directly
+			file = gz ? open_gzip(path) : fopen(path, "w");
+			if (file == NULL)
+				return false;
+			setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+			fprintf(file, "$version cache_task2 $end\n$timescale 1 ps $end\n$scope module SystemC $end\n");
+			if (trace_clock)
+				fprintf(file, "$var wire 1 ! clock $end\n");
+			for (size_t i = 0; i < probes.size(); i++)
+			{
+				// identifiers are base 94 over the printable characters after '!'
+				for (size_t n = i + 1; ; n /= 94)
+				{
+					probes[i]->id += (char)('!' + n % 94);
+					if (n < 94)
+						break;
+				}
+				fprintf(file, "$var wire %d %s %s $end\n", probes[i]->width,
+					probes[i]->id.c_str(), probes[i]->name.c_str());
+			}
+			fprintf(file, "$upscope $end\n$enddefinitions $end\n");
+			return true;
+		}
+
+		void close()
+		{
+			if (file == NULL)
+				return;
+			fclose(file);
+			file = NULL;
+			if (gzip_pid > 0)
+				waitpid(gzip_pid, NULL, 0);
+			gzip_pid = -1;
+		}
+
+	private:
+		vector<TraceProbe *> probes;
+		FILE *file;
+		pid_t gzip_pid;
+		bool dumping;
+		bool finished;
+		sc_event never;
+
+		/*
+		 * Pipe into gzip writing path. No shell is involved, so the name is
+		 * taken literally. The write end is close-on-exec so that no other
+		 * child keeps the pipe open and gzip from finishing.
+		 */
+		FILE *open_gzip(const char *path)
+		{
+			int out = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (out < 0)
+				return NULL;
+			int fd[2];
+			if (pipe(fd) < 0)
+			{
+				::close(out);
+				return NULL;
+			}
+			fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+			pid_t pid = fork();
+			if (pid == 0)
+			{
+				dup2(fd[0], 0);
+				dup2(out, 1);
+				execlp("gzip", "gzip", "-c", (char *)NULL);
+				_exit(127);
+			}
+			::close(fd[0]);
+			::close(out);
+			FILE *f = pid < 0 ? NULL : fdopen(fd[1], "w");
+			if (f == NULL)
+			{
+				::close(fd[1]);
+				if (pid > 0)
+					waitpid(pid, NULL, 0);
+				return NULL;
+			}
+			gzip_pid = pid;
+			return f;
+		}
+
+		void sample()
+		{
+			long cycle = (long)(sc_time_stamp() / period);
+
+			if (finished || file == NULL)
+			{
+				next_trigger(never);
+				return;
+			}
+			if (stop >= 0 && cycle > stop)
+			{
+				finished = true;
+				close();
+				next_trigger(never);
+				return;
+			}
+			if (cycle < start)
+			{
+				// sleep through the cycles before the window
+				next_trigger(period * (double)(start - cycle));
+				return;
+			}
+			if (trigger)
+			{
+				string a = bus_addr->read().to_string();
+				if (a.find_first_not_of("01") != string::npos
+					|| bus_addr->read().to_uint() != trigger_addr)
+					return;
+				trigger = false;
+			}
+
+			long period_ps = (long)(period.to_seconds() * 1e12 + 0.5);
+			long ps = cycle * period_ps;
+			bool stamped = false;
+
+			if (!dumping || trace_clock)
+			{
+				fprintf(file, "#%ld\n", ps);
+				stamped = true;
+			}
+			if (!dumping)
+				fprintf(file, "$dumpvars\n");
+			if (trace_clock)
+				fprintf(file, "1!\n");
+			for (size_t i = 0; i < probes.size(); i++)
+			{
+				TraceProbe *p = probes[i];
+				string v = p->value();
+				if (dumping && v == p->last)
+					continue;
+				if (!stamped)
+				{
+					fprintf(file, "#%ld\n", ps);
+					stamped = true;
+				}
+				p->last = v;
+				if (p->width == 1)
+					fprintf(file, "%s%s\n", v.c_str(), p->id.c_str());
+				else
+					fprintf(file, "b%s %s\n", v.c_str(), p->id.c_str());
+			}
+			if (!dumping)
+				fprintf(file, "$end\n");
+			if (trace_clock)
+				fprintf(file, "#%ld\n0!\n", ps + period_ps / 2);
+			dumping = true;
+		}
+};
+
+/*
+ * Interval sampling (--interval=N). Every N cycles the activity since the
+ * last sample is appended to intervals.txt, one line per interval: bus busy
+ * fraction, mean number of caches waiting for the bus, invalidations, and
+ * hits and misses per CPU. The samples are kept as signatures for the phase
+ * detection at the end of the run.
+ */
+SC_MODULE(Sampler)
+{
+	public:
+		Cache **cache;
+		Bus *bus;
+		long interval;
+		sc_time period;
+
+		// per interval: start cycle and the normalised activity
+		vector<long> starts;
+		vector< vector<double> > signatures;
+
+		SC_CTOR(Sampler)
+		{
+			SC_METHOD(sample);
+
+			cache = NULL;
+			bus = NULL;
+			interval = 0;
+			file = NULL;
+			last_cycle = 0;
+		}
+
+		~Sampler()
+		{
+			close();
+		}
+
+		bool open(const char *name)
+		{
+			file = fopen(name, "w");
+			if (file == NULL)
+				return false;
+			setvbuf(file, NULL, _IOFBF, 1 << 16);
+			fprintf(file, "cycle\tbus_busy\tbus_queue\tinvalidations");
+			for (unsigned int i = 0; i < num_cpus; i++)
+				fprintf(file, "\thits%u\tmisses%u", i, i);
+			fprintf(file, "\n");
+			last.assign(3 + 2 * num_cpus, 0);
+			return true;
+		}
+
+		// the partial interval at the end of the run
+		void finish()
+		{
+			long cycle = (long)(sc_time_stamp() / period);
+			if (file != NULL && cycle > last_cycle)
+				record(cycle);
+			close();
+		}
+
+	private:
+		FILE *file;
+		long last_cycle;
+		vector<long> last;	// counters at the last sample
+
+		void close()
+		{
+			if (file != NULL)
+				fclose(file);
+			file = NULL;
+		}
+
+		void sample()
+		{
+			long cycle = (long)(sc_time_stamp() / period);
+			if (file != NULL && cycle > 0)
+				record(cycle);
+			next_trigger(period * (double)interval);
+		}
+
+		void record(long cycle)
+		{
+			vector<long> now(3 + 2 * num_cpus);
+			now[0] = bus->busy;
+			now[1] = bus->waits;
+			now[2] = 0;
+			for (unsigned int i = 0; i < num_cpus; i++)
+			{
+				now[2] += cache[i]->invalidations;
+				now[3 + 2 * i] = cache[i]->sector_hits;
+				now[4 + 2 * i] = cache[i]->sector_misses + cache[i]->line_misses;
+			}
+
+			double cycles = cycle - last_cycle;
+			vector<double> sig(now.size());
+			fprintf(file, "%ld\t%.3f\t%.3f", last_cycle, (now[0] - last[0]) / cycles, (now[1] - last[1]) / cycles);
+			for (size_t k = 2; k < now.size(); k++)
+				fprintf(file, "\t%ld", now[k] - last[k]);
+			fprintf(file, "\n");
+			for (size_t k = 0; k < now.size(); k++)
+				sig[k] = (now[k] - last[k]) / cycles;
+
+			starts.push_back(last_cycle);
+			signatures.push_back(sig);
+			last = now;
+			last_cycle = cycle;
+		}
+};
+
+/*
+ * Phase detection over the interval signatures: every dimension scaled to
+ * [0,1], then k-means with --phases clusters, seeded with the first
+ * interval and then the one farthest from the chosen seeds. The interval
+ * closest to each centroid represents its phase. Printed and written to
+ * phases.txt, followed by the phase of each run of consecutive intervals.
+ */
+void write_phase_report(const Sampler &sampler)
+{
+	const vector< vector<double> > &raw = sampler.signatures;
+	size_t n = raw.size();
+	if (n == 0)
+		return;
+	size_t dims = raw[0].size();
+	size_t k = min((size_t)opt_phases, n);
+
+	vector< vector<double> > sig(raw);
+	for (size_t d = 0; d < dims; d++)
+	{
+		double top = 0;
+		for (size_t i = 0; i < n; i++)
+			top = max(top, sig[i][d]);
+		for (size_t i = 0; top > 0 && i < n; i++)
+			sig[i][d] /= top;
+	}
+
+	// farthest point seeding; fewer phases when the rest coincide with a centre
+	vector< vector<double> > centre;
+	vector<double> nearest(n, 1e300);
+	size_t seed = 0;
+	while (centre.size() < k)
+	{
+		centre.push_back(sig[seed]);
+		for (size_t i = 0; i < n; i++)
 		{
-			FUNC_READ,
-			FUNC_WRITE
-		};
+			double dist = 0;
+			for (size_t d = 0; d < dims; d++)
+				dist += (sig[i][d] - centre.back()[d]) * (sig[i][d] - centre.back()[d]);
+			nearest[i] = min(nearest[i], dist);
+		}
+		seed = 0;
+		for (size_t i = 1; i < n; i++)
+			if (nearest[i] > nearest[seed])
+				seed = i;
+		if (nearest[seed] == 0)
+			break;
+	}
+	k = centre.size();
 
-		enum RetCode 
+	vector<size_t> phase(n, 0);
+	for (int iter = 0; iter < 100; iter++)
+	{
+		bool moved = false;
+		for (size_t i = 0; i < n; i++)
 		{
-			RET_READ_DONE,
-			RET_WRITE_DONE,
-		};
-
-		sc_in<bool>     Port_CLK;
-		sc_in<Function> Port_Func;
-		sc_in<int>      Port_Addr;
-		sc_out<RetCode> Port_Done;
-		sc_inout_rv<32> Port_Data;
-
-		sc_out<bool> 	Port_Hit;
+			double best = 1e300;
+			size_t c_best = 0;
+			for (size_t c = 0; c < k; c++)
+			{
+				double dist = 0;
+				for (size_t d = 0; d < dims; d++)
+					dist += (sig[i][d] - centre[c][d]) * (sig[i][d] - centre[c][d]);
+				if (dist < best)
+				{
+					best = dist;
+					c_best = c;
+				}
+			}
+			if (phase[i] != c_best)
+				moved = true;
+			phase[i] = c_best;
+		}
+		for (size_t c = 0; c < k; c++)
+		{
+			vector<double> sum(dims, 0);
+			long members = 0;
+			for (size_t i = 0; i < n; i++)
+				if (phase[i] == c)
+				{
+					for (size_t d = 0; d < dims; d++)
+						sum[d] += sig[i][d];
+					members++;
+				}
+			for (size_t d = 0; members && d < dims; d++)
+				centre[c][d] = sum[d] / members;
+		}
+		if (!moved && iter > 0)
+			break;
+	}
 
-		sc_in_rv<32> 	Port_BusWriter;
-		sc_in_rv<32> 	Port_BusAddr;
-		sc_in_rv<32> 	Port_BusReq;
+	FILE *f = fopen("phases.txt", "w");
+	char line[256];
 
-		sc_port<Bus_if>	Port_Bus;
+	sprintf(line, "phase\tintervals\tfraction\trepresentative\tstart_cycle\tbus_busy\tmiss_rate\n");
+	printf("%s", line);
+	if (f != NULL)
+		fputs(line, f);
+	for (size_t c = 0; c < k; c++)
+	{
+		long members = 0;
+		double busy = 0, hits = 0, misses = 0, best = 1e300;
+		size_t rep = 0;
+		for (size_t i = 0; i < n; i++)
+		{
+			if (phase[i] != c)
+				continue;
+			members++;
+			busy += raw[i][0];
+			for (size_t d = 3; d < dims; d += 2)
+			{
+				hits += raw[i][d];
+				misses += raw[i][d + 1];
+			}
+			double dist = 0;
+			for (size_t d = 0; d < dims; d++)
+				dist += (sig[i][d] - centre[c][d]) * (sig[i][d] - centre[c][d]);
+			if (dist < best)
+			{
+				best = dist;
+				rep = i;
+			}
+		}
+		if (members == 0)
+			continue;
+		sprintf(line, "%d\t%ld\t%.3f\t%d\t%ld\t%.3f\t%.4f\n", (int)c, members, (double)members / n, (int)rep,
+			sampler.starts[rep], busy / members, hits + misses > 0 ? misses / (hits + misses) : 0.0);
+		printf("%s", line);
+		if (f != NULL)
+			fputs(line, f);
+	}
 
-		int cache_id;	
-		int snooping;
+	sprintf(line, "first_interval\tlast_interval\tphase\n");
+	printf("%s", line);
+	if (f != NULL)
+		fputs(line, f);
+	for (size_t i = 0, j; i < n; i = j)
+	{
+		for (j = i + 1; j < n && phase[j] == phase[i]; j++)
+			;
+		sprintf(line, "%d\t%d\t%d\n", (int)i, (int)(j - 1), (int)phase[i]);
+		printf("%s", line);
+		if (f != NULL)
+			fputs(line, f);
+	}
+	if (f != NULL)
+		fclose(f);
+}
 
-		SC_CTOR(Cache) 
+/*
+ * Functional copy of one Cache: tags, valid bits and the PLRU table only.
+ * Used by the host-parallel engine, which replaces the signal level
+ * handshake of Cache/CPU/Bus by a fixed per-access cost.
+ */
+class FuncCache
+{
+	public:
+		FuncCache()
 		{
-			SC_THREAD(execute);
-			sensitive << Port_CLK.pos();
-			dont_initialize();
-
-			SC_THREAD(snoop);
-			sensitive << Port_CLK.pos();
-			dont_initialize();
+			memset(valid, 0, sizeof(valid));
+			memset(tag, 0, sizeof(tag));
+			memset(lru_table, 0, sizeof(lru_table));
+		}
 
-			//m_data = new int[MEM_SIZE];
-			cache = new aca_cache;
-			lru_table= new unsigned char[CACHE_LINES] ;
-			for (int i = 0; i<8; i++)
-				valid_lines[i] = false;
-			for (int j = 0; j< CACHE_LINES; j++)
-				lru_table[j] = 0;
+		// returns the set holding addr or -1, a hit updates the lru bits
+		int lookup(unsigned int addr)
+		{
+			unsigned int line_index = (addr & 0x00000FE0) >> 5;
+			for (int i = 0; i < CACHE_SETS; i++)
+			{
+				if (valid[i][line_index] && tag[i][line_index] == (addr >> 12))
+				{
+					lru_touch(lru_table[line_index], i);
+					return i;
+				}
+			}
+			return -1;
 		}
 
-		~Cache() 
+		// allocate addr, first invalid set else the lru victim
+		int fill(unsigned int addr, bool *evicted)
 		{
-			//delete[] m_data;
-			delete cache;
-			delete lru_table;
+			unsigned int line_index = (addr & 0x00000FE0) >> 5;
+			int set = -1;
+			for (int i = 0; i < CACHE_SETS && set < 0; i++)
+				if (!valid[i][line_index])
+					set = i;
+			*evicted = (set < 0);
+			if (set < 0)
+				set = lru_victim(lru_table[line_index]);
+			valid[set][line_index] = true;
+			tag[set][line_index] = addr >> 12;
+			lru_touch(lru_table[line_index], set);
+			return set;
+		}
 
+		bool invalidate(unsigned int addr)
+		{
+			unsigned int line_index = (addr & 0x00000FE0) >> 5;
+			for (int i = 0; i < CACHE_SETS; i++)
+			{
+				if (valid[i][line_index] && tag[i][line_index] == (addr >> 12))
+				{
+					valid[i][line_index] = false;
+					return true;
+				}
+			}
+			return false;
 		}
+
 	private:
-		aca_cache *cache;
-		unsigned char *lru_table;
-		bool valid_lines[8];
-		char *binary (unsigned char v) { 
-			static char binstr[9] ; 
-			int i ; 
+		bool valid[CACHE_SETS][CACHE_LINES];
+		unsigned int tag[CACHE_SETS][CACHE_LINES];
+		unsigned short lru_table[CACHE_LINES];
+};
 
-			binstr[8] = '\0' ; 
-			for (i=0; i<8; i++) { 
-				binstr[7-i] = v & 1 ? '1' : '0' ; 
-				v = v / 2 ; 
-			} 
+/* One tracefile entry in the global order the CPUs consume the trace in */
+struct TraceRecord
+{
+	int cpu;
+	TraceFile::Entry entry;
+};
 
-			return binstr ; 
-		} 
+/* Read the whole tracefile, round robin over the CPUs as CPU::execute would */
+static void load_trace(vector<TraceRecord> &records)
+{
+	TraceRecord rec;
 
-		void snoop()
+	records.clear();
+	while(!trace_source->eof())
+	{
+		for (unsigned int i = 0; i < num_cpus && !trace_source->eof(); i++)
 		{
-
-			while (true)
+			if(!trace_source->next(i, rec.entry))
 			{
-#if 1
-				wait(Port_BusReq.value_changed_event());
-				int writer = Port_BusWriter.read().to_int();
-				if(writer != cache_id){
-					cout<<"I am cache: "<< cache_id <<"snooped"<<endl;
-
-					cout<< "Cache id: " << writer <<endl; 
-					int addr= Port_BusAddr.read().to_int();
-					aca_cache_line *c_line;
-					sc_uint<20> tag = 0;
-					unsigned int line_index;
-					line_index = (addr & 0x00000FE0) >> 5;
-					tag = addr >> 12;
-					int req = Port_BusReq.read().to_int();
-					cout<< "Snoooooping bussss " << req <<endl; 
+				cerr << "Error reading trace for CPU" << endl;
+				return;
+			}
+			rec.cpu = i;
+			records.push_back(rec);
+		}
+	}
+}
 
-					switch(req)
-					{
-						case BUS_RD:
-							/* do nothing
-							   for ( int i=0; i <CACHE_SETS; i++ ){
-							   c_line = &(cache->cache_set[i].cache_line[line_index]);
-							   if (c_line -> valid == true){
-							   if ( c_line -> tag == tag){
-							//flush data to the bus
+/*
+ * Hits and misses per CPU of the last functional engine run. The aca2009
+ * statistics cannot be read back, and --check compares these with a
+ * detailed run, see check_engine.
+ */
+struct EngineCounts
+{
+	long readhit, readmiss, writehit, writemiss;
+};
 
-							}
+vector<EngineCounts> engine_counts;
 
-							}
-							}
-							 */
-							ProbeReads ++;
-							break;
-						case BUS_RDX:
+/* Add hits and misses of one CPU to the statistics and engine_counts */
+static void engine_stats(int cpu, long readhit, long readmiss, long writehit, long writemiss)
+{
+	EngineCounts &c = engine_counts[cpu];
+
+	for (long n = 0; n < readhit; n++)   stats_readhit(cpu);
+	for (long n = 0; n < readmiss; n++)  stats_readmiss(cpu);
+	for (long n = 0; n < writehit; n++)  stats_writehit(cpu);
+	for (long n = 0; n < writemiss; n++) stats_writemiss(cpu);
+	sim_accesses += readhit + readmiss + writehit + writemiss;
+	c.readhit += readhit;
+	c.readmiss += readmiss;
+	c.writehit += writehit;
+	c.writemiss += writemiss;
+}
 
-						case BUS_WR:
-							for ( int i=0; i <CACHE_SETS; i++ ){
-								c_line = &(cache->cache_set[i].cache_line[line_index]);
-								if (c_line -> valid == true){
-									if ( c_line -> tag == tag){
-										c_line -> valid = false;
-									}
+/* Single producer / single consumer ring, the capacity is rounded up to a power of two */
+template <class T>
+class SpscQueue
+{
+	public:
+		SpscQueue() : mask(0), head(0), tail(0) {}
 
-								}
-							}
-							ProbeWrites ++;
+		void reserve(size_t n)
+		{
+			size_t size = 1;
+			while (size < n)
+				size <<= 1;
+			ring.resize(size);
+			mask = size - 1;
+		}
 
-							break;
+		bool push(const T &v)
+		{
+			size_t t = tail.load(memory_order_relaxed);
+			if (t - head.load(memory_order_acquire) == ring.size())
+				return false;
+			ring[t & mask] = v;
+			tail.store(t + 1, memory_order_release);
+			return true;
+		}
 
+		bool pop(T &v)
+		{
+			size_t h = head.load(memory_order_relaxed);
+			if (h == tail.load(memory_order_acquire))
+				return false;
+			v = ring[h & mask];
+			head.store(h + 1, memory_order_release);
+			return true;
+		}
 
-						default:
-							cout<<"a invalid command was issued in the end"<<endl;
-							break;
+	private:
+		vector<T> ring;
+		size_t mask;
+		atomic<size_t> head;
+		atomic<size_t> tail;
+};
 
-					}
-				}
-			wait();
-#endif
+class Barrier
+{
+	public:
+		Barrier(int n) : count(n), waiting(0), generation(0) {}
 
+		void wait()
+		{
+			unique_lock<mutex> lock(m);
+			long gen = generation;
+			if (++waiting == count)
+			{
+				waiting = 0;
+				generation++;
+				cv.notify_all();
 			}
-
+			else
+				cv.wait(lock, [&]{ return gen != generation; });
 		}
 
-		void execute() 
-		{
-			while (true)
-			{
-				cout<<"waiting for wr function"<< cache_id << endl;
-				wait(Port_Func.value_changed_event());
-				cout<<"I am cache: "<< cache_id <<endl;
+	private:
+		mutex m;
+		condition_variable cv;
+		int count;
+		int waiting;
+		long generation;
+};
 
-				Function f = Port_Func.read();
-				int addr   = Port_Addr.read();
-				//Port_Wr_Func.write(f);
-				//int *data;
-				aca_cache_line *c_line;
-				sc_uint<20> tag = 0;
-				unsigned int line_index;
-				unsigned int word_index = 0;
-				bool hit   = false;
-				int hit_set = -1;
-				//cout << sc_time_stamp() << " Function is " << f << endl;
+/*
+ * Host-parallel simulation (--parallel). Every CPU+Cache pair runs on its
+ * own host thread for opt_quantum cycles at a time, assuming the bus is
+ * free. The bus transactions a core issued are drained from its outbound
+ * queue at the quantum boundary, sorted by (cycle, cpu) and arbitrated;
+ * the resulting bus waits are charged to the core at the start of the
+ * next quantum and the invalidations are delivered through the inbound
+ * queues of the other cores. Both are late by less than one quantum, this
+ * is the timing skew written to parallel.txt at the end.
+ *
+ * Expected error at the default quantum of 1000 cycles, against the
+ * detailed model on 4 CPUs x 2000 accesses: hit and miss counts match on
+ * stride, random, prodcons and falseshare. Migratory turns 6 of its 4000
+ * write hits into misses, because an invalidation that arrives up to a
+ * quantum late lets a stale line hit. Zipf moves about 1% of its reads
+ * between hit and miss. Bus waits, a few dozen cycles in a whole run, are
+ * off by up to a factor of three, and the execution time by up to 1.3%.
+ * With --quantum=100 or less, migratory matches as well. Zipf stays about
+ * 1% off at any quantum, because this engine charges fixed latencies in
+ * bus order. Each quantum costs a barrier of all threads, so --quantum=10
+ * runs about 80 times slower than the default.
+ *
+ * Per access cost, as in the detailed model: read hit 1, read miss
+ * 2 + 8*100 (+ 8*100 to write back a replaced line), write hit 3 + 8*100
+ * (write through), write miss 2 + 8*100 fill + 8*100 write through.
+ */
+struct BusMsg
+{
+	long time;
+	int cpu;
+	int req;
+	unsigned int addr;
+};
 
-				//determine whether a hit
-				cout << "addr: " << hex << addr << endl;
-				line_index = (addr & 0x00000FE0) >> 5;
-				tag = addr >> 12;
-				cout << "line_index: " << line_index <<  " tag: " <<tag << endl;
-				word_index = ( addr & 0x0000001C ) >> 2;
-				for ( int i=0; i <CACHE_SETS; i++ ){
-					c_line = &(cache->cache_set[i].cache_line[line_index]);
-					if (c_line -> valid == true){
-						valid_lines[i] = true;	
-						if ( c_line -> tag == tag){
-							hit = true;
-							hit_set=i; 
-						}
+/*
+ * Bus messages one core can issue in a quantum: a core starts accesses
+ * only before the end of the quantum, and every access that goes to the
+ * bus costs at least 2 + 8*100 cycles (a write at least 3 + 8*100).
+ */
+#define PAR_BUS_MIN_CYCLES 802
+#define PAR_WRITE_MIN_CYCLES 803
 
-					}
-					else{
-						valid_lines[i] = false;
-					}
-				}
-#ifdef MASK
+struct ParCore
+{
+	int id;
+	FuncCache l1;
+	vector<TraceFile::Entry> *trace;
+	size_t pos;
+	long time;
+	long penalty;
+	long readhit, readmiss, writehit, writemiss;
+	SpscQueue<BusMsg> out;
+	SpscQueue<BusMsg> in;
+};
 
-				cout << "before replacing--------------" <<endl;
-				cout<<"lru_table: "<<binary(lru_table[line_index])<<endl;
-				cout <<setw(8) << "set"<< setw(8) <<  "valid" << setw(8) <<  "tag" <<endl;
-#endif
-				for (int set = 0; set < 8; set++){ 
-					c_line = &(cache->cache_set[set].cache_line[line_index]);
-#ifdef MASK
-					cout <<setw(8)<<  set <<setw(8) << c_line -> valid << setw(8)<< c_line -> tag <<endl; 
-#endif
-				}
+/* The queues are sized from the bounds above, a full one is a bug in them */
+static void par_push(SpscQueue<BusMsg> &q, const BusMsg &m)
+{
+	if (!q.push(m))
+	{
+		cerr << "Parallel simulation: bus message queue overflow" << endl;
+		abort();
+	}
+}
 
-				if (f == FUNC_WRITE) 
-				{
-					int cpu_data = Port_Data.read().to_int();
+static void par_core_quantum(ParCore *c, long q_end)
+{
+	BusMsg m;
 
-					cout << sc_time_stamp() << ": MEM received write" << endl;
-					if (hit){ //write hit
+	// snoops of the previous quantum, already in bus order
+	while (c->in.pop(m))
+		c->l1.invalidate(m.addr);
+	c->time += c->penalty;
+	c->penalty = 0;
 
-						Port_Bus->write(cache_id, addr, cpu_data);//issue bus write for a write hit 
-						stats_writehit(cache_id);
+	while (c->pos < c->trace->size() && c->time < q_end)
+	{
+		TraceFile::Entry &tr_data = (*c->trace)[c->pos++];
+		bool evicted;
 
-						Port_Hit.write(true);
-						//Port_Hit_Line.write(hit_set);
-						c_line = &(cache->cache_set[hit_set].cache_line[line_index]);
+		m.time = c->time;
+		m.cpu = c->id;
+		m.addr = tr_data.addr;
 
-						c_line -> data[word_index] = cpu_data;
-						wait();//consume 1 cycle
-						cout << sc_time_stamp() << ": Cache write hit!" << endl;
-						//sth need to do with lru
-						switch (hit_set)
-						{
-							case 0: lru_table[line_index] |=0b1101000; break;
-							case 1: lru_table[line_index]  = (lru_table[line_index]  & 0b0010111) | 0b1100000;break;
-							case 2: lru_table[line_index]  = (lru_table[line_index]  & 0b0011011) | 0b1000100;break;
-							case 3: lru_table[line_index]  = (lru_table[line_index]  & 0b0011011) | 0b1000000;break;
-							case 4: lru_table[line_index]  = (lru_table[line_index]  & 0b0101101) | 0b0010010;break;
-							case 5: lru_table[line_index]  = (lru_table[line_index]  & 0b0101101) | 0b0010000;break;
-							case 6: lru_table[line_index]  = (lru_table[line_index]  & 0b0101110) | 0b0000001;break;
-							case 7: lru_table[line_index]  = (lru_table[line_index]  & 0b0101110);break;
-							default: cout << "Damn here !!!!" << endl;
+		switch(tr_data.type)
+		{
+			case TraceFile::ENTRY_TYPE_READ:
+				if (c->l1.lookup(tr_data.addr) >= 0)
+				{
+					c->readhit++;
+					c->time += 1;
+					break;
+				}
+				m.req = Cache::BUS_RD;
+				par_push(c->out, m);
+				c->l1.fill(tr_data.addr, &evicted);
+				c->readmiss++;
+				c->time += 2 + 8*100 + (evicted ? 8*100 : 0);
+				break;
+
+			case TraceFile::ENTRY_TYPE_WRITE:
+				if (c->l1.lookup(tr_data.addr) >= 0)
+				{
+					m.req = Cache::BUS_WR;
+					par_push(c->out, m);
+					c->writehit++;
+					c->time += 3 + 8*100;
+					break;
+				}
+				m.req = Cache::BUS_RDX;
+				par_push(c->out, m);
+				c->l1.fill(tr_data.addr, &evicted);
+				c->writemiss++;
+				c->time += 2 + 8*100 + 8*100;
+				break;
+
+			default:
+				c->time += 1;
+				break;
+		}
+	}
+}
 
-						}
+static bool bus_msg_before(const BusMsg &a, const BusMsg &b)
+{
+	return a.time != b.time ? a.time < b.time : a.cpu < b.cpu;
+}
+
+static void par_core_thread(ParCore *c, Barrier *barrier, const long *q_end, const bool *stop)
+{
+	while (true)
+	{
+		barrier->wait();
+		if (*stop)
+			break;
+		par_core_quantum(c, *q_end);
+		barrier->wait();
+	}
+}
+
+/*
+ * Timing skew of a --parallel run, printed and written to parallel.txt:
+ * how late the snooped writes were delivered and the longest bus wait
+ * charged at a quantum boundary, in cycles.
+ */
+static void write_parallel_report(long snoops, long skew_max, double skew_avg, long delay_max)
+{
+	FILE *f = fopen("parallel.txt", "w");
+	char line[256];
+
+	sprintf(line, "threads\tquantum\tsnooped_writes\tskew_max\tskew_avg\tbus_wait_max\n");
+	printf("%s", line);
+	if (f != NULL)
+		fputs(line, f);
+	sprintf(line, "%u\t%ld\t%ld\t%ld\t%.1f\t%ld\n", num_cpus, opt_quantum, snoops, skew_max, skew_avg, delay_max);
+	printf("%s", line);
+	if (f != NULL)
+		fputs(line, f);
+	if (f != NULL)
+		fclose(f);
+}
+
+void run_parallel(long *waits, long *reads, long *writes, long *cycles)
+{
+	vector<TraceRecord> records;
+	vector< vector<TraceFile::Entry> > streams(num_cpus);
+	load_trace(records);
+	for (size_t k = 0; k < records.size(); k++)
+		streams[records[k].cpu].push_back(records[k].entry);
+
+	ParCore *core = new ParCore[num_cpus];
+	for (unsigned int i = 0; i < num_cpus; i++)
+	{
+		core[i].id = i;
+		core[i].trace = &streams[i];
+		core[i].pos = 0;
+		core[i].time = 0;
+		core[i].penalty = 0;
+		core[i].readhit = core[i].readmiss = core[i].writehit = core[i].writemiss = 0;
+		// one quantum of messages; the inbound queue only gets the writes of the others
+		core[i].out.reserve(opt_quantum / PAR_BUS_MIN_CYCLES + 2);
+		core[i].in.reserve((num_cpus - 1) * (opt_quantum / PAR_WRITE_MIN_CYCLES + 2) + 1);
+	}
 
-					}
-					else //write miss
-					{		
-						Port_Bus->writex(cache_id, addr, cpu_data);//issue bus readx when write miss -> didnt see rdx in this case
-						stats_writemiss(cache_id);
+	Barrier barrier(num_cpus + 1);
+	long q_end = 0;
+	bool stop = false;
+	vector<thread> threads;
+	for (unsigned int i = 0; i < num_cpus; i++)
+		threads.push_back(thread(par_core_thread, &core[i], &barrier, &q_end, &stop));
 
-						Port_Hit.write(false);
-						cout << sc_time_stamp() << ": Cache write miss!" << endl;
+	vector<BusMsg> msgs;
+	long bus_free = 0;
+	long skew_max = 0, skew_sum = 0, skew_count = 0;
+	long delay_max = 0;
+	*waits = *reads = *writes = 0;
 
-						for ( int i=0; i <CACHE_SETS; i++ ){
-							if (valid_lines[i] == false){ //use an invalid line
-								// write allocate
-								c_line = &(cache->cache_set[i].cache_line[line_index]);
-								cout << "Write waiting for global access " << cache_id <<endl; 
-								for (int j = 0; j < 8; j++)
-								{
-									wait(100); //fetch 8 * words data from memory to cache
-									c_line -> data[j] = rand()%10000; //load the memory line(32bytes) to the appropriate cache line
-								}
-								c_line -> data[word_index] = cpu_data; //actual write from processor to cache line
-								c_line -> valid = true;
-								c_line -> tag = tag;
-								//update the lru table after the cache update
-								switch (i)
-								{
-									case 0: lru_table[line_index] |=0b1101000; break;
-									case 1: lru_table[line_index]  = (lru_table[line_index]  & 0b0010111) | 0b1100000;break;
-									case 2: lru_table[line_index]  = (lru_table[line_index]  & 0b0011011) | 0b1000100;break;
-									case 3: lru_table[line_index]  = (lru_table[line_index]  & 0b0011011) | 0b1000000;break;
-									case 4: lru_table[line_index]  = (lru_table[line_index]  & 0b0101101) | 0b0010010;break;
-									case 5: lru_table[line_index]  = (lru_table[line_index]  & 0b0101101) | 0b0010000;break;
-									case 6: lru_table[line_index]  = (lru_table[line_index]  & 0b0101110) | 0b0000001;break;
-									case 7: lru_table[line_index]  = (lru_table[line_index]  & 0b0101110);break;
+	while (true)
+	{
+		bool done = true;
+		for (unsigned int i = 0; i < num_cpus; i++)
+			if (core[i].pos < core[i].trace->size())
+				done = false;
+		stop = done;
+		q_end += opt_quantum;
+
+		barrier.wait();
+		if (stop)
+			break;
+		barrier.wait();
+
+		// quantum boundary: arbitrate the bus in a deterministic order
+		BusMsg m;
+		msgs.clear();
+		for (unsigned int i = 0; i < num_cpus; i++)
+			while (core[i].out.pop(m))
+				msgs.push_back(m);
+		sort(msgs.begin(), msgs.end(), bus_msg_before);
+
+		for (size_t k = 0; k < msgs.size(); k++)
+		{
+			BusMsg &msg = msgs[k];
+			long grant = max(msg.time, bus_free);
+			long delay = grant - msg.time;
 
+			bus_free = grant + 1;
+			*waits += delay;
+			core[msg.cpu].penalty += delay;
+			delay_max = max(delay_max, delay);
 
-								}
-								break;
+			if (msg.req == Cache::BUS_RD)
+			{
+				(*reads)++;
+				ProbeReads += num_cpus - 1;
+				continue;
+			}
+			(*writes)++;
+			ProbeWrites += num_cpus - 1;
+			for (unsigned int i = 0; i < num_cpus; i++)
+				if ((int)i != msg.cpu)
+					par_push(core[i].in, msg);
+
+			// the snoop lands at the start of the next quantum
+			long skew = q_end - msg.time;
+			skew_max = max(skew_max, skew);
+			skew_sum += skew;
+			skew_count++;
+		}
+	}
 
-							}
-#if 1
-							else if(i == CACHE_SETS-1){// all lines are valid
-								//lru
-								//write back the previous line to mem and replace the lru line 
-								int set_index_toreplace = 8;
+	for (unsigned int i = 0; i < threads.size(); i++)
+		threads[i].join();
 
+	*cycles = 0;
+	engine_counts.assign(num_cpus, EngineCounts());
+	for (unsigned int i = 0; i < num_cpus; i++)
+	{
+		*cycles = max(*cycles, core[i].time + core[i].penalty);
+		engine_stats(i, core[i].readhit, core[i].readmiss, core[i].writehit, core[i].writemiss);
+	}
 
-								if ( (lru_table[line_index]  & 0b1101000) == 0 ){ //find the cache line to replace
-									c_line = &(cache->cache_set[0].cache_line[line_index]);
-									set_index_toreplace = 0;
-								}
-								else if ( (lru_table[line_index]  & 0b1101000) == 0b0001000 ) {
-									c_line = &(cache->cache_set[1].cache_line[line_index]);
-									set_index_toreplace = 1;
-								}
-								else if ( (lru_table[line_index]  & 0b1100100) == 0b0100000 ) {
-									c_line = &(cache->cache_set[2].cache_line[line_index]);
-									set_index_toreplace = 2;
-								}
-								else if ( (lru_table[line_index]  & 0b1100100) == 0b0100100 ) {
-									c_line = &(cache->cache_set[3].cache_line[line_index]);
-									set_index_toreplace = 3;
-								}
-								else if ( (lru_table[line_index]  & 0b1010010) == 0b1000000 ) {
-									c_line = &(cache->cache_set[4].cache_line[line_index]);
-									set_index_toreplace = 4;
-								}
-								else if ( (lru_table[line_index]  & 0b1010010) == 0b1000010 ) {
-									c_line = &(cache->cache_set[5].cache_line[line_index]);
-									set_index_toreplace = 5;
-								}
-								else if ( (lru_table[line_index]  & 0b1010001) == 0b1010000 ) {
-									c_line = &(cache->cache_set[6].cache_line[line_index]);
-									set_index_toreplace = 6;
-								}
-								else if ( (lru_table[line_index]  & 0b1010001) == 0b1010001 ) {
-									c_line = &(cache->cache_set[7].cache_line[line_index]);
-									set_index_toreplace = 7;
-								}
-								cout<< "Replacing now the cache line in set ....." << set_index_toreplace << endl;
+	cout << "Parallel simulation: " << num_cpus << " threads, quantum " << opt_quantum << " cycles" << endl;
+	write_parallel_report(skew_count, skew_max, skew_count ? (double)skew_sum / skew_count : 0.0, delay_max);
 
-								//Port_Replace_Line.write(set_index_toreplace);
+	delete[] core;
+}
 
-								/*no needed becuase every time we write to cache, we also write back to memory 
-								  for(int i=0; i<8;i++)//write the cache line back to the memory
-								  wait(100);
-								 */
 
-								// write allocate
-								for (int i = 0; i< 8; i++){
-									wait(100); //fetch 8 * words data from memory to cache
-									c_line -> data[i] = rand()%10000; //load the memory line(32bytes) to the appropriate cache line
-								}
+/*
+ * Set-sharded functional simulation (--shards=N). Lookup, PLRU update and
+ * snoop invalidation of an access only touch its own line_index, so the
+ * 128 indices are dealt out round robin over N workers. Every worker walks
+ * the whole trace in global order but only simulates the accesses that fall
+ * in its slice, for all CPUs. There is no timing in this mode.
+ */
+struct ShardStats
+{
+	vector<long> readhit, readmiss, writehit, writemiss;
+	long reads, writes, invalidations;
+};
 
-								// Replace the word in the cache line and make it valid
-								c_line -> data[word_index] =  cpu_data; //actual write from processor to cache line
-								c_line -> valid = true;
-								c_line -> tag = tag;
-								switch (set_index_toreplace)
-								{
-									case 0: lru_table[line_index] |=0b1101000; break;
-									case 1: lru_table[line_index]  = (lru_table[line_index]  & 0b0010111) | 0b1100000;break;
-									case 2: lru_table[line_index]  = (lru_table[line_index]  & 0b0011011) | 0b1000100;break;
-									case 3: lru_table[line_index]  = (lru_table[line_index]  & 0b0011011) | 0b1000000;break;
-									case 4: lru_table[line_index]  = (lru_table[line_index]  & 0b0101101) | 0b0010010;break;
-									case 5: lru_table[line_index]  = (lru_table[line_index]  & 0b0101101) | 0b0010000;break;
-									case 6: lru_table[line_index]  = (lru_table[line_index]  & 0b0101110) | 0b0000001;break;
-									case 7: lru_table[line_index]  = (lru_table[line_index]  & 0b0101110);break;
-									default: cout << "Buggy here !!!!! should not come here" <<endl; 
-
-								}	
+static void shard_worker(const vector<TraceRecord> *records, int shard, int shards, ShardStats *st)
+{
+	vector<FuncCache> l1(num_cpus);
+	bool evicted;
 
-							}
-#endif
-						}
-					}
-#if 1
-					//adding this becuase of write through
-					for(int i=0; i<8;i++)//write the cache line back to the memory for both write his and miss
-						wait(100);
-#endif
+	st->readhit.assign(num_cpus, 0);
+	st->readmiss.assign(num_cpus, 0);
+	st->writehit.assign(num_cpus, 0);
+	st->writemiss.assign(num_cpus, 0);
+	st->reads = st->writes = st->invalidations = 0;
 
-					Port_Done.write( RET_WRITE_DONE );
-					//Port_Wr_Done.write ( RET_WRITE_DONE );
+	for (size_t k = 0; k < records->size(); k++)
+	{
+		const TraceRecord &rec = (*records)[k];
+		unsigned int addr = rec.entry.addr;
+		int cpu = rec.cpu;
 
-					//cout << sc_time_stamp() << ": MEM received write" << endl;
-					//data = Port_Data.read().to_int();
-				}
-				else//a read comes to cache
-				{
-					cout << sc_time_stamp() << ": MEM received read" << endl;
+		if (rec.entry.type == TraceFile::ENTRY_TYPE_NOP
+			|| (int)(((addr & 0x00000FE0) >> 5) % shards) != shard)
+			continue;
 
-					if (hit){ //read hit
-						stats_readhit(cache_id);// do nothing for a read hit.
+		if (rec.entry.type == TraceFile::ENTRY_TYPE_READ)
+		{
+			if (l1[cpu].lookup(addr) >= 0)
+				st->readhit[cpu]++;
+			else
+			{
+				st->readmiss[cpu]++;
+				st->reads++;
+				l1[cpu].fill(addr, &evicted);
+			}
+			continue;
+		}
 
-						Port_Hit.write(true);
-						//Port_Hit_Line.write(hit_set);
-						c_line = &(cache->cache_set[hit_set].cache_line[line_index]);
+		if (l1[cpu].lookup(addr) >= 0)
+			st->writehit[cpu]++;
+		else
+		{
+			st->writemiss[cpu]++;
+			l1[cpu].fill(addr, &evicted);
+		}
+		st->writes++;
+		for (unsigned int i = 0; i < num_cpus; i++)
+			if ((int)i != cpu && l1[i].invalidate(addr))
+				st->invalidations++;
+	}
+}
 
-						Port_Data.write( c_line -> data[word_index] );
-						cout << sc_time_stamp() << ": Cache read hit!" << endl;
-						//some lru stuff needed to be done
-						switch (hit_set)
-						{	
-							case 0: lru_table[line_index] |=0b1101000; break;
-							case 1: lru_table[line_index]  = (lru_table[line_index]  & 0b0010111) | 0b1100000;break;
-							case 2: lru_table[line_index]  = (lru_table[line_index]  & 0b0011011) | 0b1000100;break;
-							case 3: lru_table[line_index]  = (lru_table[line_index]  & 0b0011011) | 0b1000000;break;
-							case 4: lru_table[line_index]  = (lru_table[line_index]  & 0b0101101) | 0b0010010;break;
-							case 5: lru_table[line_index]  = (lru_table[line_index]  & 0b0101101) | 0b0010000;break;
-							case 6: lru_table[line_index]  = (lru_table[line_index]  & 0b0101110) | 0b0000001;break;
-							case 7: lru_table[line_index]  = (lru_table[line_index]  & 0b0101110);break;
-							default: cout << "Damn here !!!!" << endl;
+void run_sharded(long *reads, long *writes)
+{
+	vector<TraceRecord> records;
+	load_trace(records);
+
+	int shards = min(opt_shards, CACHE_LINES);
+	vector<ShardStats> st(shards);
+	vector<thread> threads;
+	for (int w = 0; w < shards; w++)
+		threads.push_back(thread(shard_worker, &records, w, shards, &st[w]));
+	for (int w = 0; w < shards; w++)
+		threads[w].join();
+
+	long invalidations = 0;
+	*reads = *writes = 0;
+	engine_counts.assign(num_cpus, EngineCounts());
+	for (int w = 0; w < shards; w++)
+	{
+		*reads += st[w].reads;
+		*writes += st[w].writes;
+		invalidations += st[w].invalidations;
+		for (unsigned int i = 0; i < num_cpus; i++)
+			engine_stats(i, st[w].readhit[i], st[w].readmiss[i], st[w].writehit[i], st[w].writemiss[i]);
+	}
+	ProbeReads += *reads * (num_cpus - 1);
+	ProbeWrites += *writes * (num_cpus - 1);
 
-						}
+	cout << "Sharded functional simulation: " << shards << " workers, "
+		<< records.size() << " trace entries, " << invalidations << " invalidations" << endl;
+}
 
-					}
-					else //read miss
-					{		
-						Port_Bus->read(cache_id, addr); // issue a bus read for a read miss
-						stats_readmiss(cache_id);
+/* Statistics of a finished run, printed and written to myfile.txt / exec.txt */
+/* Totals of the last write_report, for the result of a server job */
+long report_waits, report_reads, report_writes;
+string report_exec_time;
 
-						Port_Hit.write(false);
-						cout << sc_time_stamp() << ": Cache read miss!" << endl;
+void write_report(long waits, long reads, long writes, const char *exec_time)
+{
+	char buffer[4096];
+
+	report_waits = waits;
+	report_reads = reads;
+	report_writes = writes;
+	report_exec_time = exec_time;
+
+	stats_print(buffer);
+	cout<<endl;
+	strcat(buffer,"CPU\tProbeReads\tProbeWrites\n");
+	char temp[1024];
+	for(unsigned int i =0; i < num_cpus; i++)
+	{
+		sprintf(temp,"%d\t%d\t%d\n", i, ProbeReads,ProbeWrites);
+		strcat(buffer,temp);
+	}
+	cout<<endl;
+	strcat(buffer,"waits\treads\twrites\ttotal_access(r+w)\twait_per_access\n");
 
-						for ( int i=0; i <CACHE_SETS; i++ ){
-							if (valid_lines[i] == false){ //use an invalid line
-								// write allocate
-								c_line = &(cache->cache_set[i].cache_line[line_index]);
-								cout << "Read waiting for global access " << cache_id <<endl; 
-								for (int j = 0; j < 8; j++)
-								{
-									wait(100); //fetch 8 * words data from memory to cache
-									c_line -> data[j] = rand()%10000; //load the memory line(32bytes) to the appropriate cache line
-								}
-								Port_Data.write(c_line -> data[word_index]); //return data to the CPU
-								c_line -> valid = true;
-								c_line -> tag = tag;
-								//update the lru table after the cache update
-								switch (i)
-								{	case 0: lru_table[line_index] |=0b1101000; break;
-									case 1: lru_table[line_index]  = (lru_table[line_index]  & 0b0010111) | 0b1100000;break;
-									case 2: lru_table[line_index]  = (lru_table[line_index]  & 0b0011011) | 0b1000100;break;
-									case 3: lru_table[line_index]  = (lru_table[line_index]  & 0b0011011) | 0b1000000;break;
-									case 4: lru_table[line_index]  = (lru_table[line_index]  & 0b0101101) | 0b0010010;break;
-									case 5: lru_table[line_index]  = (lru_table[line_index]  & 0b0101101) | 0b0010000;break;
-									case 6: lru_table[line_index]  = (lru_table[line_index]  & 0b0101110) | 0b0000001;break;
-									case 7: lru_table[line_index]  = (lru_table[line_index]  & 0b0101110);break;
-								}
-								break;
+	long total_accesses = reads+writes;
+	memset(temp,0,sizeof(temp));
 
-							}
-#if 1
-							else if(i == CACHE_SETS-1){// all lines are valid
-								//lru
-								int set_index_toreplace = 8;
-								if ( (lru_table[line_index]  & 0b1101000) == 0 ){ //find the cache line to replace
-									c_line = &(cache->cache_set[0].cache_line[line_index]);
-									set_index_toreplace = 0;
-								}
-								else if ( (lru_table[line_index]  & 0b1101000) == 0b0001000 ) {
-									c_line = &(cache->cache_set[1].cache_line[line_index]);
-									set_index_toreplace = 1;
-								}
-								else if ( (lru_table[line_index]  & 0b1100100) == 0b0100000 ) {
-									c_line = &(cache->cache_set[2].cache_line[line_index]);
-									set_index_toreplace = 2;
-								}
-								else if ( (lru_table[line_index]  & 0b1100100) == 0b0100100 ) {
-									c_line = &(cache->cache_set[3].cache_line[line_index]);
-									set_index_toreplace = 3;
-								}
-								else if ( (lru_table[line_index]  & 0b1010010) == 0b1000000 ) {
-									c_line = &(cache->cache_set[4].cache_line[line_index]);
-									set_index_toreplace = 4;
-								}
-								else if ( (lru_table[line_index]  & 0b1010010) == 0b1000010 ) {
-									c_line = &(cache->cache_set[5].cache_line[line_index]);
-									set_index_toreplace = 5;
-								}
-								else if ( (lru_table[line_index]  & 0b1010001) == 0b1010000 ) {
-									c_line = &(cache->cache_set[6].cache_line[line_index]);
-									set_index_toreplace = 6;
-								}
-								else if ( (lru_table[line_index]  & 0b1010001) == 0b1010001 ) {
-									c_line = &(cache->cache_set[7].cache_line[line_index]);
-									set_index_toreplace = 7;
-								}
-								cout<< "Replacing now the cache line in set ....." << set_index_toreplace << endl;
+	sprintf(temp,"%ld\t%ld\t%ld\t%ld\t%f\n",waits, reads, writes, total_accesses,(double)((float)waits/(float)total_accesses));
 
-								//Port_Replace_Line.write(set_index_toreplace);
+	strcat(buffer,temp);
+	printf("%s",buffer);
 
-								//write back the previous line to mem 
-								for(int i=0; i<8;i++)//write the cache line back to the memory
-									wait(100);
+	FILE * pFile;
+	pFile = fopen ("myfile.txt","w");
+	if (pFile!=NULL)
+	{
+		fputs(buffer, pFile);
+		fclose (pFile);
+	}
 
-								// write allocate
-								for (int i = 0; i< 8; i++){
-									wait(100); //fetch 8 * words data from memory to cache
-									c_line -> data[i] = rand()%10000; //load the memory line(32bytes) to the appropriate cache line
-								}
+	ofstream myfile;
+	myfile.open ("exec.txt");
+	myfile << exec_time;
+	myfile.close();
+}
 
-								// Replace the word in the cache line and make it valid
-								Port_Data.write(c_line -> data[word_index]);//read from the cache line and give it to CPU 
-								c_line -> valid = true;
-								c_line -> tag = tag;
-								switch (set_index_toreplace)
-								{
-									case 0: lru_table[line_index] |=0b1101000; break;
-									case 1: lru_table[line_index]  = (lru_table[line_index]  & 0b0010111) | 0b1100000;break;
-									case 2: lru_table[line_index]  = (lru_table[line_index]  & 0b0011011) | 0b1000100;break;
-									case 3: lru_table[line_index]  = (lru_table[line_index]  & 0b0011011) | 0b1000000;break;
-									case 4: lru_table[line_index]  = (lru_table[line_index]  & 0b0101101) | 0b0010010;break;
-									case 5: lru_table[line_index]  = (lru_table[line_index]  & 0b0101101) | 0b0010000;break;
-									case 6: lru_table[line_index]  = (lru_table[line_index]  & 0b0101110) | 0b0000001;break;
-									case 7: lru_table[line_index]  = (lru_table[line_index]  & 0b0101110);break;
-									default: cout << "Damn here !!!!" << endl;
+/* Per CPU miss classes, printed and written to missclass.txt */
+void write_miss_report(Cache **cache)
+{
+	FILE *f = fopen("missclass.txt", "w");
+	char line[256];
+
+	sprintf(line, "CPU\tcompulsory\tcapacity\tconflict\ttrue_sharing\tfalse_sharing\n");
+	printf("%s", line);
+	if (f != NULL)
+		fputs(line, f);
+	for (unsigned int i = 0; i < num_cpus; i++)
+	{
+		const long *c = cache[i]->classifier.count;
+		sprintf(line, "%d\t%ld\t%ld\t%ld\t%ld\t%ld\n", i, c[MISS_COMPULSORY], c[MISS_CAPACITY],
+			c[MISS_CONFLICT], c[MISS_TRUE_SHARING], c[MISS_FALSE_SHARING]);
+		printf("%s", line);
+		if (f != NULL)
+			fputs(line, f);
+	}
+	if (f != NULL)
+		fclose(f);
+}
 
-								}
-							}
-#endif
-						}
-					}
+/*
+ * Translation per CPU, printed and written to tlb.txt: TLB hits and misses,
+ * page walk references and how many of them missed the cache, and the mean
+ * cycles of a walk.
+ */
+void write_tlb_report(Cache **cache)
+{
+	FILE *f = fopen("tlb.txt", "w");
+	char line[256];
+
+	sprintf(line, "CPU\ttlb_hits\ttlb_misses\tmiss_rate\twalk_refs\twalk_misses\tmean_walk_cycles\tpages\tpage_size\talloc\n");
+	printf("%s", line);
+	if (f != NULL)
+		fputs(line, f);
+	for (unsigned int i = 0; i < num_cpus; i++)
+	{
+		Cache *c = cache[i];
+		long lookups = c->tlb_hits + c->tlb_misses;
+		sprintf(line, "%d\t%ld\t%ld\t%.4f\t%ld\t%ld\t%.1f\t%lu\t%lu\t%s\n", i, c->tlb_hits, c->tlb_misses,
+			lookups ? (double)c->tlb_misses / lookups : 0.0, c->walk_refs, c->walk_misses,
+			c->tlb_misses ? (double)c->walk_cycles / c->tlb_misses : 0.0, page_table.pages(),
+			opt_page_size, page_alloc_names[opt_page_alloc]);
+		printf("%s", line);
+		if (f != NULL)
+			fputs(line, f);
+	}
+	if (f != NULL)
+		fclose(f);
+}
 
+/*
+ * Memory channel use, printed and written to memory.txt: transfers, words,
+ * utilization of the run, mean and longest queueing per channel.
+ */
+void write_memory_report(const MemorySystem &mem, long cycles)
+{
+	FILE *f = fopen("memory.txt", "w");
+	char line[256];
+
+	sprintf(line, "channel\ttransfers\twords\tbusy_cycles\tutilization\tmean_queue_cycles\tmax_queue\tinterleave\n");
+	printf("%s", line);
+	if (f != NULL)
+		fputs(line, f);
+	for (size_t i = 0; i < mem.channels.size(); i++)
+	{
+		const MemorySystem::Channel &c = mem.channels[i];
+		sprintf(line, "%d\t%ld\t%ld\t%ld\t%.3f\t%.1f\t%ld\t%s\n", (int)i, c.transfers, c.words, c.busy,
+			cycles ? (double)c.busy / cycles : 0.0, c.transfers ? (double)c.queued / c.transfers : 0.0,
+			c.max_queue, interleave_names[opt_interleave]);
+		printf("%s", line);
+		if (f != NULL)
+			fputs(line, f);
+	}
+	if (f != NULL)
+		fclose(f);
+}
 
+/*
+ * Lock workload summary, printed and written to lock.txt: handoff and
+ * acquire latency, failed atomic attempts, bus locking, and the shared
+ * counter against its expected value as a check of mutual exclusion.
+ * Then the atomics and failed store-conditionals per CPU.
+ */
+void write_lock_report(LockSource *lock, Cache **cache, long bus_locks, long bus_lock_waits)
+{
+	FILE *f = fopen("lock.txt", "w");
+	char line[512];
+	const LatencyHistogram &h = lock->handoffs();
+	const LatencyHistogram &a = lock->acquire_latency();
+
+	sprintf(line, "workload\tcpus\tacquisitions\thandoffs\thandoff_p50\thandoff_p90\thandoff_p99\thandoff_max\t"
+		"acquire_p50\tacquire_p99\tfailed_attempts\tbus_locks\tbus_lock_waits\tcounter\texpected\n");
+	printf("%s", line);
+	if (f != NULL)
+		fputs(line, f);
+	sprintf(line, "%s\t%u\t%ld\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%ld\t%ld\t%ld\t%d\t%ld\n", synth_names[opt_synth],
+		num_cpus, lock->acquisitions(), h.count, h.percentile(50), h.percentile(90), h.percentile(99), h.max,
+		a.percentile(50), a.percentile(99), lock->failed_attempts(), bus_locks, bus_lock_waits,
+		lock->counter(), lock->expected_counter());
+	printf("%s", line);
+	if (f != NULL)
+		fputs(line, f);
+
+	sprintf(line, "CPU\tatomics\tsc_failures\n");
+	printf("%s", line);
+	if (f != NULL)
+		fputs(line, f);
+	for (unsigned int i = 0; i < num_cpus; i++)
+	{
+		sprintf(line, "%d\t%ld\t%ld\n", i, cache[i]->atomics, cache[i]->sc_failures);
+		printf("%s", line);
+		if (f != NULL)
+			fputs(line, f);
+	}
+	if (f != NULL)
+		fclose(f);
+}
 
-					//wait();
-					//Port_Wr_Done.write ( RET_READ_DONE );
-					Port_Done.write( RET_READ_DONE );
-					wait();
-					Port_Data.write("ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ");
-				}
-#ifdef MASK
-				//at here means a read or a write has happened
-				cout << "after replacing----------------------" <<endl;
-				cout <<"lru_table: "<<binary(lru_table[line_index])<<endl;
-				//cout <<"use invalid line in set: "<<
-				cout <<setw(8) << "set"<< setw(8) <<  "valid" << setw(8) <<  "tag" <<endl;
-#endif
-				for (int set = 0; set < 8; set++){
-					c_line = &(cache->cache_set[set].cache_line[line_index]);
-#ifdef MASK
-					cout <<setw(8)<<  set <<setw(8) << c_line -> valid << setw(8)<< c_line -> tag <<endl; 
-#endif
-				}
-				cout<<endl;
+/* What --check compared without finding a divergence, printed and written to check.txt */
+void write_check_report(const Checker &check)
+{
+	FILE *f = fopen("check.txt", "w");
+	char line[256];
+
+	sprintf(line, "accesses_checked\taccesses_skipped\tsnoops_checked\tinstalls_checked\ttransactions_checked"
+		"\tvalues_checked\tdivergences\n");
+	printf("%s", line);
+	if (f != NULL)
+		fputs(line, f);
+	sprintf(line, "%ld\t%ld\t%ld\t%ld\t%ld\t%ld\t0\n", check.accesses, check.skipped, check.snoops,
+		check.installs, check.transactions, check.values);
+	printf("%s", line);
+	if (f != NULL)
+		fputs(line, f);
+	if (f != NULL)
+		fclose(f);
+}
 
+/*
+ * Differential check of a functional engine (--check with --parallel or
+ * --shards). The engines share no code with Cache, so the golden model
+ * does not apply. Instead simulate() runs the same trace through the
+ * detailed model afterwards, and this compares the two runs, printed and
+ * written to check.txt. Every CPU must make the same number of reads and
+ * writes in both. Its hits and misses may differ by ENGINE_TOLERANCE
+ * percent of those reads or writes, and the bus reads and writes by that
+ * percent of their count: --parallel delivers snoops up to a quantum
+ * late and --shards in trace order, see the expected error at
+ * run_parallel. Bus waits and the execution time are only reported.
+ * Returns the exit status, 1 if a counter is off by more.
+ */
+#define ENGINE_TOLERANCE 2
 
-				/*
-				// This simulates memory read/write delayc
-				wait(99);
+static int engine_row(FILE *f, const char *name, long engine, long detailed, long limit)
+{
+	char line[256];
+	bool off = limit >= 0 && labs(engine - detailed) > limit;
+
+	if (limit >= 0)
+		sprintf(line, "%s\t%ld\t%ld\t%ld\t%s\n", name, engine, detailed, limit, off ? "off" : "ok");
+	else
+		sprintf(line, "%s\t%ld\t%ld\t-\treported\n", name, engine, detailed);
+	printf("%s", line);
+	if (f != NULL)
+		fputs(line, f);
+	return off;
+}
 
-				if (f == FUNC_READ) 
-				{
-				//Port_Data.write( (addr < MEM_SIZE) ? m_data[addr] : 0 );
-				Port_Done.write( RET_READ_DONE );
-				wait();
-				Port_Data.write("ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ");
-				}
-				else
-				{
-				if (addr < MEM_SIZE) 
-				{
-				//	m_data[addr] = data;
-				}
-				Port_Done.write( RET_WRITE_DONE );
-				}
-				 */
-			}
-		}
-}; 
+int check_engine(Cache **cache, const Bus &bus, long waits, long reads, long writes, long cycles)
+{
+	const char *engine = opt_parallel ? "parallel" : "shards";
+	FILE *f = fopen("check.txt", "w");
+	char line[256];
+	char name[64];
+	int off = 0;
+
+	sprintf(line, "counter\t%s\tdetailed\tlimit\tstatus\n", engine);
+	printf("%s", line);
+	if (f != NULL)
+		fputs(line, f);
+	for (unsigned int i = 0; i < num_cpus; i++)
+	{
+		const EngineCounts &e = engine_counts[i];
+		long readhit = cache[i]->read_hits, readmiss = cache[i]->read_misses;
+		long writehit = cache[i]->write_hits, writemiss = cache[i]->write_misses;
+		long read_limit = (readhit + readmiss) * ENGINE_TOLERANCE / 100;
+		long write_limit = (writehit + writemiss) * ENGINE_TOLERANCE / 100;
+
+		sprintf(name, "cpu%u_reads", i);
+		off += engine_row(f, name, e.readhit + e.readmiss, readhit + readmiss, 0);
+		sprintf(name, "cpu%u_writes", i);
+		off += engine_row(f, name, e.writehit + e.writemiss, writehit + writemiss, 0);
+		sprintf(name, "cpu%u_read_hits", i);
+		off += engine_row(f, name, e.readhit, readhit, read_limit);
+		sprintf(name, "cpu%u_read_misses", i);
+		off += engine_row(f, name, e.readmiss, readmiss, read_limit);
+		sprintf(name, "cpu%u_write_hits", i);
+		off += engine_row(f, name, e.writehit, writehit, write_limit);
+		sprintf(name, "cpu%u_write_misses", i);
+		off += engine_row(f, name, e.writemiss, writemiss, write_limit);
+	}
+	off += engine_row(f, "bus_reads", reads, bus.reads, bus.reads * ENGINE_TOLERANCE / 100);
+	off += engine_row(f, "bus_writes", writes, bus.writes, bus.writes * ENGINE_TOLERANCE / 100);
+	if (opt_parallel)
+	{
+		engine_row(f, "bus_waits", waits, bus.waits, -1);
+		engine_row(f, "cycles", cycles, now_cycles(), -1);
+	}
+	sprintf(line, "divergences\t%d\n", off);
+	printf("%s", line);
+	if (f != NULL)
+	{
+		fputs(line, f);
+		fclose(f);
+	}
+	if (off == 0)
+		return 0;
+	cerr << "Divergence of the " << engine << " engine from the detailed simulation: " << off
+		<< " counters beyond " << ENGINE_TOLERANCE << "%, see check.txt" << endl;
+	return 1;
+}
 
-class Bus : public Bus_if,public sc_module
+/* Victim cache hits and misses per CPU, printed and written to victim.txt */
+void write_victim_report(Cache **cache)
 {
+	FILE *f = fopen("victim.txt", "w");
+	char line[256];
+
+	sprintf(line, "CPU\tvictim_hits\tvictim_misses\tvictim_evictions\tentries\n");
+	printf("%s", line);
+	if (f != NULL)
+		fputs(line, f);
+	for (unsigned int i = 0; i < num_cpus; i++)
+	{
+		sprintf(line, "%d\t%ld\t%ld\t%ld\t%d\n", i, cache[i]->victim_hits,
+			cache[i]->victim_misses, cache[i]->victim_evictions, opt_victim);
+		printf("%s", line);
+		if (f != NULL)
+			fputs(line, f);
+	}
+	if (f != NULL)
+		fclose(f);
+}
 
-	public:
-#if 0
-		enum BUS_REQ 
-		{
-			BUS_RD,
-			BUS_WR,
-			BUS_RDX,//-> seems have same response with BUS_WR
-			BUS_INVALID
-		};
-#endif
-		// ports
-		sc_in<bool> Port_CLK;
-		sc_signal_rv<32> Port_BusReq;
-		sc_signal_rv<32> Port_BusWriter;
+/*
+ * Configuration and behaviour of each CPU's cache (--cache-config),
+ * printed and written to cache.txt
+ */
+void write_cache_report(Cache **cache)
+{
+	FILE *f = fopen("cache.txt", "w");
+	char line[256];
+
+	sprintf(line, "CPU\tsize\tways\tpolicy\thit_cycles\tprefetch\thits\tmisses\thit_rate"
+		"\tprefetches\tprefetch_hits\tprefetch_late\tprefetch_dropped\n");
+	printf("%s", line);
+	if (f != NULL)
+		fputs(line, f);
+	for (unsigned int i = 0; i < num_cpus; i++)
+	{
+		const CacheConfig &c = cache[i]->config;
+		long hits = cache[i]->sector_hits;
+		long misses = cache[i]->sector_misses + cache[i]->line_misses;
+		sprintf(line, "%d\t%lu\t%d\t%s\t%d\t%s\t%ld\t%ld\t%.4f\t%ld\t%ld\t%ld\t%ld\n", i, c.size, c.ways,
+			replacement_names[c.policy], c.hit_cycles, prefetch_names[c.prefetch], hits, misses,
+			hits + misses ? (double)hits / (hits + misses) : 0.0, cache[i]->prefetches,
+			cache[i]->prefetch_hits, cache[i]->prefetch_late, cache[i]->prefetch_dropped);
+		printf("%s", line);
+		if (f != NULL)
+			fputs(line, f);
+	}
+	if (f != NULL)
+		fclose(f);
+}
 
-		sc_signal_rv<32> Port_BusAddr;
+/* Sector hits and misses per CPU, printed and written to sector.txt */
+void write_sector_report(Cache **cache)
+{
+	FILE *f = fopen("sector.txt", "w");
+	char line[256];
+
+	sprintf(line, "CPU\tsector_hits\tsector_misses\tline_misses\twords_per_sector\n");
+	printf("%s", line);
+	if (f != NULL)
+		fputs(line, f);
+	for (unsigned int i = 0; i < num_cpus; i++)
+	{
+		sprintf(line, "%d\t%ld\t%ld\t%ld\t%d\n", i, cache[i]->sector_hits,
+			cache[i]->sector_misses, cache[i]->line_misses, opt_sector);
+		printf("%s", line);
+		if (f != NULL)
+			fputs(line, f);
+	}
+	if (f != NULL)
+		fclose(f);
+}
 
-		sc_mutex bus;
+/* Write-update traffic per CPU, printed and written to update.txt */
+void write_update_report(Cache **cache, long bus_updates)
+{
+	FILE *f = fopen("update.txt", "w");
+	char line[256];
+
+	sprintf(line, "CPU\tupdates_sent\tupdates_received\tbroadcasts_skipped\n");
+	printf("%s", line);
+	if (f != NULL)
+		fputs(line, f);
+	for (unsigned int i = 0; i < num_cpus; i++)
+	{
+		sprintf(line, "%d\t%ld\t%ld\t%ld\n", i, cache[i]->updates_sent,
+			cache[i]->updates_received, cache[i]->broadcasts_skipped);
+		printf("%s", line);
+		if (f != NULL)
+			fputs(line, f);
+	}
+	sprintf(line, "bus_updates\t%ld\n", bus_updates);
+	printf("%s", line);
+	if (f != NULL)
+	{
+		fputs(line, f);
+		fclose(f);
+	}
+}
 
-		long waits;
-		long reads;
-		long writes;
-	public:
-		SC_CTOR(Bus)
+/* Per CPU latency percentiles, printed and written to latency.txt */
+void write_latency_report(CPU **cpu)
+{
+	static const char *op_name[3] = { "read", "write", "atomic" };
+	static const char *class_name[3] = { "hit", "miss", "coh_miss" };
+	FILE *f = fopen("latency.txt", "w");
+	char line[256];
+
+	sprintf(line, "CPU\top\tclass\tcount\tp50\tp90\tp99\tmax\n");
+	printf("%s", line);
+	if (f != NULL)
+		fputs(line, f);
+	for (unsigned int i = 0; i < num_cpus; i++)
+	{
+		for (int op = 0; op < 3; op++)
 		{
-			// Handle Port_CLK to simulate delay
-			// Initialize some bus properties
-			sensitive << Port_CLK.pos();
-			Port_BusAddr.write("ZZZZZZZZZZZZZZZZZZZZZ");
-			Port_BusReq.write("ZZZZZZZZZZZZZZZZZZZZZ");
-			Port_BusWriter.write("ZZZZZZZZZZZZZZZZZZZZZ");
-
-			waits = 0;
-			reads = 0;
-			writes = 0; 
+			for (int c = 0; c < 3; c++)
+			{
+				const LatencyHistogram &h = cpu[i]->latency[op][c];
+				if (h.count == 0)
+					continue;
+				sprintf(line, "%d\t%s\t%s\t%lu\t%lu\t%lu\t%lu\t%lu\n", i, op_name[op], class_name[c],
+					h.count, h.percentile(50), h.percentile(90), h.percentile(99), h.max);
+				printf("%s", line);
+				if (f != NULL)
+					fputs(line, f);
+			}
 		}
-#if 1
-		virtual bool read(int writer, int addr)
-		{
-			cout<<"before locking mutex Read "<< writer <<endl;
-			while(bus.trylock() == -1){
-				cout<<"gagagaggagagga rd"<<endl;
-				waits++;
-				wait();
-				cout<<"hahahhahahahah rd"<<endl;
+	}
+	if (f != NULL)
+		fclose(f);
+}
 
-			}
-			reads++;
+/*
+ * Host side cost of the run (--bench), one tab separated line in bench.txt
+ * for script_bench: simulated accesses, wall seconds, accesses per second,
+ * peak RSS in kB and kernel delta cycles per access (0 for the engines that
+ * do not run the SystemC kernel).
+ */
+void write_bench_report(double wall, unsigned long deltas)
+{
+	struct rusage ru;
+	char line[256];
 
-			Port_BusAddr.write(addr);
-			Port_BusWriter.write(writer);
-			Port_BusReq.write(0x00);
+	getrusage(RUSAGE_SELF, &ru);
+	sprintf(line, "%ld\t%f\t%.0f\t%ld\t%f\n", sim_accesses, wall,
+		wall > 0 ? sim_accesses / wall : 0.0, (long)ru.ru_maxrss,
+		sim_accesses ? (double)deltas / sim_accesses : 0.0);
+	printf("accesses\twall_s\taccesses_per_s\tpeak_rss_kb\tdeltas_per_access\n%s", line);
+
+	FILE *f = fopen("bench.txt", "w");
+	if (f != NULL)
+	{
+		fputs(line, f);
+		fclose(f);
+	}
+}
+
+/*
+ * Set trace_source and num_cpus: a synthetic or lock workload, a trace
+ * already in memory (server jobs), or the tracefile argument. Returns the
+ * lock workload, if that is what runs.
+ */
+static LockSource *select_source(int *argc, char ***argv, const LoadedTrace *trace)
+{
+	LockSource *lock_source = NULL;
+	if (opt_synth >= SYNTH_SPINLOCK)
+	{
+		num_cpus = opt_cpus;
+		lock_source = new LockSource((SynthKind)opt_synth, opt_cpus, opt_accesses);
+		trace_source = lock_source;
+		sync_values = true;
+	}
+	else if (opt_synth != SYNTH_NONE)
+	{
+		num_cpus = opt_cpus;
+		trace_source = new SyntheticSource((SynthKind)opt_synth, opt_cpus, opt_accesses, opt_wss,
+			opt_seed, opt_write_ratio, opt_nop_ratio, opt_stride, opt_zipf);
+	}
+	else if (trace != NULL)
+	{
+		num_cpus = trace->streams.size();
+		trace_source = new ReplayTraceSource(&trace->streams);
+	}
+	else
+	{
+		init_tracefile(argc, argv);
+		trace_source = new FileTraceSource;
+	}
+	return lock_source;
+}
 
-			//wait for everyone to revieve
-			cout<<"before wait rd"<<endl;
-			wait();
-			cout<<"after wait rd"<<endl;
-			Port_BusReq.write("ZZZZZZZZZZZZZZZZZZZZZ");
-			Port_BusAddr.write("ZZZZZZZZZZZZZZZZZZZZZ");
-			Port_BusWriter.write("ZZZZZZZZZZZZZZZZZZZZZ");
+/*
+ * The simulation proper once the trace source is set: one of the
+ * functional engines, or the SystemC netlist. Returns the exit status.
+ *
+ * With --check a functional engine is followed by a detailed run of the
+ * same trace, read into memory first so both get the same entries. Its
+ * reports are not written, check_engine compares it with the engine's.
+ */
+static int simulate(chrono::steady_clock::time_point host_start, LockSource *lock_source)
+{
+	long waits = 0, reads = 0, writes = 0, cycles = 0;
+	LoadedTrace *engine_trace = NULL;
 
-			cout<<"before unlock"<<endl;
-			bus.unlock();
-			cout<<"after unlocking mutex Read "<< writer <<endl;
+	// Initialize statistics counters
+	stats_init();
 
-			return true;
+	if (opt_check && (opt_parallel || opt_shards))
+	{
+		vector<TraceRecord> records;
+		load_trace(records);
+		engine_trace = new LoadedTrace;
+		engine_trace->streams.resize(num_cpus);
+		for (size_t k = 0; k < records.size(); k++)
+			engine_trace->streams[records[k].cpu].push_back(records[k].entry);
+		delete trace_source;
+		trace_source = new ReplayTraceSource(&engine_trace->streams);
+	}
 
-		}
+	if (opt_parallel)
+	{
+		char exec_time[64];
+
+		run_parallel(&waits, &reads, &writes, &cycles);
+		sprintf(exec_time, "%ld ns", cycles);
+		write_report(waits, reads, writes, exec_time);
+		if (opt_bench)
+			write_bench_report(chrono::duration<double>(chrono::steady_clock::now() - host_start).count(), 0);
+		if (engine_trace == NULL)
+			return 0;
+	}
 
-		virtual bool write(int writer, int addr, int data) 
-		{
-			cout<<"before locking mutex Write "<< writer <<endl;
-			while(bus.trylock() == -1){
-				cout<<"gagagaggagagga write"<<endl;
-				waits++;
-				wait();
-				cout<<"hahahhahahahah write"<<endl;
-			}
+	if (opt_shards)
+	{
+		run_sharded(&reads, &writes);
+		write_report(0, reads, writes, "untimed");
+		if (opt_bench)
+			write_bench_report(chrono::duration<double>(chrono::steady_clock::now() - host_start).count(), 0);
+		if (engine_trace == NULL)
+			return 0;
+	}
 
-			writes++;
+	if (engine_trace != NULL)
+	{
+		delete trace_source;
+		trace_source = new ReplayTraceSource(&engine_trace->streams);
+		cout << "Detailed simulation of the same trace for --check" << endl;
+	}
+#if 0
+	// Instantiate Modules
+	Cache mem("main_memory");
+	CPU    cpu("cpu");
+
+	// Signals
+	sc_buffer<Cache::Function> sigMemFunc;
+	sc_buffer<Cache::RetCode>  sigMemDone;
+	sc_signal<int>              sigMemAddr;
+	sc_signal_rv<32>            sigMemData;
+	sc_signal<bool> 	sigMemHit;
+	sc_signal<bool>              sigMemWr_Done;
+	sc_signal<bool>              sigMemWr_Func;
+	sc_signal<int>              sigMemHitLine;
+	sc_signal<int>              sigMemReplaceLine;
+	// The clock that will drive the CPU and Cache
+	sc_clock clk;
+
+	// Connecting module ports with signals
+	mem.Port_Func(sigMemFunc);
+	mem.Port_Addr(sigMemAddr);
+	mem.Port_Data(sigMemData);
+	mem.Port_Done(sigMemDone);
+	mem.Port_Hit(sigMemHit);
+	mem.Port_Wr_Done(sigMemWr_Done);
+	mem.Port_Wr_Func(sigMemWr_Func);
+	mem.Port_Hit_Line(sigMemHitLine);
+	mem.Port_Replace_Line(sigMemReplaceLine);
+
+	cpu.Port_MemFunc(sigMemFunc);
+	cpu.Port_MemAddr(sigMemAddr);
+	cpu.Port_MemData(sigMemData);
+	cpu.Port_MemDone(sigMemDone);
+
+	mem.Port_CLK(clk);
+	cpu.Port_CLK(clk);
+#endif
 
-			Port_BusAddr.write(addr);
-			Port_BusWriter.write(writer);
-			Port_BusReq.write(0x01);
 
-			cout<<"before wait wr"<<endl;
-			wait();
-			cout<<"after wait wr"<<endl;
-			Port_BusReq.write("ZZZZZZZZZZZZZZZZZZZZZ");
-			Port_BusAddr.write("ZZZZZZZZZZZZZZZZZZZZZ");
-			Port_BusWriter.write("ZZZZZZZZZZZZZZZZZZZZZ");
+	int snooping = 1;
 
-			cout<<"before unlock WR"<<endl;
-			bus.unlock();
-			cout<<"after unlocking mutex Write "<< writer <<endl;
+	Bus bus("bus");
 
-			return true;
-		}
+	sc_clock clk;
+	clk_period = clk.period();
+	memory.init(opt_channels);
+	page_table.init(opt_page_size, opt_seed);
+	//sc_signal<int>            sigBusWriter;
+	//sc_buffer<Cache::BUS_REQ> sigBusReq;
+	//sc_signal_rv<32>          sigBusAddr;
 
-		virtual bool writex(int writer, int addr, int data) 
-		{
-			cout<<"before locking mutex ReadEX "<< writer <<endl;
+	//bus.Port_BusAddr(sigBusAddr);	
+	//bus.Port_BusWriter(sigBusWriter);
+	//bus.Port_BusReq(sigBusReq);
+	bus.Port_CLK(clk);
 
-			while(bus.trylock() == -1){
-				cout<<"gagagaggagagga rdex"<<endl;
-				waits++;
-				wait();
-				cout<<"hahahhahahahah rdex"<<endl;
-			}
+	
+	//sigBusAddr.write("ZZZZZZZZZZZZZZZZZZZZZ");
+	//sigBusReq.write(Cache::BUS_INVALID);
 
-			writes++;
+	sc_buffer<Cache::Function>  sigMemFunc[num_cpus];
+	sc_signal<int>              sigMemAddr[num_cpus];
+	sc_signal_rv<32>            sigMemData[num_cpus];
+	sc_buffer<Cache::RetCode>   sigMemDone[num_cpus];
+	sc_signal<bool> 	    sigMemHit[num_cpus];
+	sc_signal<int> 	    sigMemOutcome[num_cpus];
+	sc_signal<int> 	    sigMemAtomic[num_cpus];
+	sc_signal<int> 	    sigMemExpected[num_cpus];
 
-			Port_BusAddr.write(addr);
-			cout<<"before wait 0"<<endl;
-			Port_BusReq.write(0x02);
-			cout<<"before wait 1"<<endl;
-			Port_BusWriter.write(writer);
+	Cache *cache[num_cpus];
+	CPU   *cpu[num_cpus];
 
-			cout<<"before wait rdex"<<endl;
-			wait();
-			cout<<"after wait rdex"<<endl;
-			Port_BusReq.write("ZZZZZZZZZZZZZZZZZZZZZ");
-			Port_BusAddr.write("ZZZZZZZZZZZZZZZZZZZZZ");
-			Port_BusWriter.write("ZZZZZZZZZZZZZZZZZZZZZ");
+	for(unsigned int i = 0; i < num_cpus; i++)
+	{
+		char name_cache[12];
+		char name_cpu[12];
+
+		sprintf(name_cache, "cache_%d", i);
+		sprintf(name_cpu, "cpu_%d", i);
+
+		/* Create objects for Cache and CPU */	
+		cache[i] = new Cache(name_cache, cache_config(i));
+		cpu[i] = new CPU(name_cpu);
+
+		/* Set IDs */
+		cpu[i]->cpu_id = i;
+		cache[i]->cache_id = i;
+		cache[i]->snooping = snooping;
+
+		/* Connect Cache to Bus */
+		cache[i]->Port_BusAddr(bus.Port_BusAddr);	
+		cache[i]->Port_BusWriter(bus.Port_BusWriter);	
+		cache[i]->Port_BusReq(bus.Port_BusReq);	
+		cache[i]->Port_BusData(bus.Port_BusData);
+		cache[i]->Port_Bus(bus);
+
+		/* Connect Cache to CPU */
+		cache[i]->Port_Func(sigMemFunc[i]);	
+		cache[i]->Port_Addr(sigMemAddr[i]);	
+		cache[i]->Port_Data(sigMemData[i]);	
+		cache[i]->Port_Done(sigMemDone[i]);	
+		cache[i]->Port_Hit(sigMemHit[i]);
+		cache[i]->Port_Outcome(sigMemOutcome[i]);
+		cache[i]->Port_Atomic(sigMemAtomic[i]);
+		cache[i]->Port_Expected(sigMemExpected[i]);
+
+		/* Connect CPU to Cache */
+		cpu[i]->Port_MemFunc(sigMemFunc[i]);	
+		cpu[i]->Port_MemAddr(sigMemAddr[i]);	
+		cpu[i]->Port_MemData(sigMemData[i]);	
+		cpu[i]->Port_MemDone(sigMemDone[i]);	
+		cpu[i]->Port_MemOutcome(sigMemOutcome[i]);
+		cpu[i]->Port_MemAtomic(sigMemAtomic[i]);
+		cpu[i]->Port_MemExpected(sigMemExpected[i]);
+
+		/* Connect clocks */
+		cache[i]->Port_CLK(clk);
+		cpu[i]->Port_CLK(clk);
+	}
 
-			cout<<"before unlock ReadEX"<<endl;
-			bus.unlock();
 
-			cout<<"after unlocking mutex ReadEX "<< writer <<endl;
-			return true;
-		}
-#endif
-};
 
-SC_MODULE(CPU) 
-{
+	cout << "Running (press CTRL+C to interrupt)... " << endl;
 
-	public:
-		sc_in<bool>                Port_CLK;
-		sc_in<Cache::RetCode>   Port_MemDone;
-		sc_out<Cache::Function> Port_MemFunc;
-		sc_out<int>                Port_MemAddr;
-		sc_inout_rv<32>            Port_MemData;
-		int cpu_id;
+	Checker *check = NULL;
+	if (opt_check && engine_trace == NULL)
+	{
+		check = new Checker(num_cpus);
+		checker = check;
+	}
 
-		SC_CTOR(CPU) 
+	Sampler *sampler = NULL;
+	if (opt_interval)
+	{
+		sampler = new Sampler("sampler");
+		sampler->cache = cache;
+		sampler->bus = &bus;
+		sampler->interval = opt_interval;
+		sampler->period = clk.period();
+		if (!sampler->open("intervals.txt"))
 		{
-			SC_THREAD(execute);
-			sensitive << Port_CLK.pos();
-			dont_initialize();
+			cerr << "Cannot open intervals.txt" << endl;
+			return 1;
 		}
+	}
 
-	private:
-		void execute() 
+	Tracer *tracer = NULL;
+	if (opt_trace)
+	{
+		tracer = new Tracer("tracer");
+		tracer->Port_CLK(clk);
+		tracer->period = clk.period();
+		tracer->start = opt_trace_start;
+		tracer->stop = opt_trace_stop;
+		tracer->trigger = opt_trace_trigger;
+		tracer->trigger_addr = opt_trace_addr;
+		tracer->bus_addr = &bus.Port_BusAddr;
+		tracer->trace_clock = (opt_trace & TRACE_CLK) != 0;
+
+		// Dump the desired signals
+		for(unsigned int i=0; (opt_trace & TRACE_CPU) && i<num_cpus; i++)
 		{
-			TraceFile::Entry    tr_data;
-			Cache::Function  f;
+			char addr_cpu[16];
+			char data_cpu[16];
+			char hit_cache[16];
 
-			// Loop until end of tracefile
-			while(!tracefile_ptr->eof())
-			{
-				// Get the next action for the processor in the trace
-				if(!tracefile_ptr->next(cpu_id, tr_data))
-				{
-					cerr << "Error reading trace for CPU" << endl;
-					break;
-				}
+			sprintf(addr_cpu, "cpu_addr_%d", i);
+			sprintf(data_cpu, "cpu_data_%d", i);
+			sprintf(hit_cache, "cache_hit_%d", i);
 
-				// To demonstrate the statistic functions, we generate a 50%
-				// probability of a 'hit' or 'miss', and call the statistic
-				// functions below
-				//int j = rand()%2;
+			tracer->add(new SignalProbe<int>(&sigMemAddr[i], 32), addr_cpu);
+			tracer->add(new ResolvedProbe(&sigMemData[i]), data_cpu);
+			tracer->add(new SignalProbe<bool>(&sigMemHit[i], 1), hit_cache);
+		}
+		if (opt_trace & TRACE_BUS)
+		{
+			tracer->add(new ResolvedProbe(&bus.Port_BusAddr), "addr_on_bus");
+			tracer->add(new ResolvedProbe(&bus.Port_BusWriter), "writer_on_bus");
+			tracer->add(new ResolvedProbe(&bus.Port_BusReq), "req_on_bus");
+		}
+		if (!tracer->open(opt_trace_file, opt_trace_gz))
+			cerr << "Cannot open trace file " << opt_trace_file << endl;
+	}
 
-				switch(tr_data.type)
-				{
-					case TraceFile::ENTRY_TYPE_READ:
-						f = Cache::FUNC_READ;
-						/*
-						   if(j)
-						   stats_readhit(0);
-						   else
-						   stats_readmiss(0);
-						 */
-						break;
 
-					case TraceFile::ENTRY_TYPE_WRITE:
-						f = Cache::FUNC_WRITE;
-						/*
-						   if(j)
-						   stats_writehit(0);
-						   else
-						   stats_writemiss(0);
-						 */						
-						break;
+	// Start Simulation
+	//sc_start(42500,SC_NS);
+	sc_start();
+	if (tracer)
+		tracer->close();
+	if (sampler)
+		sampler->finish();
+	if (engine_trace != NULL)
+		return check_engine(cache, bus, waits, reads, writes, cycles);
+
+
+	// Print statistics after simulation finished
+	ostringstream exec_time;
+	exec_time << sc_time_stamp();
+	write_report(bus.waits, bus.reads, bus.writes, exec_time.str().c_str());
+	write_latency_report(cpu);
+	write_miss_report(cache);
+	if (opt_protocol != PROTOCOL_INVALIDATE)
+		write_update_report(cache, bus.updates);
+	if (opt_sector != 8)
+		write_sector_report(cache);
+	if (opt_victim)
+		write_victim_report(cache);
+	if (opt_cache_config)
+		write_cache_report(cache);
+	if (lock_source)
+		write_lock_report(lock_source, cache, bus.locks, bus.lock_waits);
+	if (opt_channels)
+		write_memory_report(memory, now_cycles());
+	if (opt_tlb)
+		write_tlb_report(cache);
+	if (sampler)
+		write_phase_report(*sampler);
+	if (check)
+		write_check_report(*check);
+	if (opt_bench)
+		write_bench_report(chrono::duration<double>(chrono::steady_clock::now() - host_start).count(), sc_delta_count());
+	return 0;
+}
 
-					case TraceFile::ENTRY_TYPE_NOP:
-						break;
+/*
+ * Simulation server (--server=SOCKET). Reading the tracefile is the
+ * largest cost of small runs, so the server stays up and reads each
+ * tracefile once, keeping it in memory for every later job. SystemC
+ * elaborates only once per process, so each job runs in a forked child:
+ * it inherits the loaded traces, parses the job's options on top of the
+ * server's own, simulates in DIR/job-N (--server-dir) and writes
+ * result.json there. Up to --server-jobs jobs run at once. Only the
+ * parsed traces are shared, every job still elaborates its own netlist.
+ *
+ * A job is one line on the socket, the same arguments as the command
+ * line, e.g.
+ *
+ *   --protocol=dragon --victim=8 tracefiles/fft_16_p4.trf
+ *   --synth=ticket --cpus=16 --accesses=1000
+ *
+ * and its answer one JSON line, in completion order:
+ *
+ *   {"job":3,"status":"ok","exit":0,"dir":"jobs/job-3","result":{...}}
+ *
+ * Example client: nc -U SOCKET < jobs.txt
+ *
+ * The server is multithreaded, and a child forked from it would have only
+ * the thread that forked it, with any lock another thread held (the heap's
+ * too) locked forever. So the server never forks. Before it starts any
+ * thread it forks the forker, a single threaded process that loads and
+ * keeps the traces and forks the jobs. A job thread sends it the job line
+ * and one end of a socket pair, and reads the job's exit code from the
+ * other end. For every job the forker forks a watcher that forks the job
+ * itself, waits for it and writes back its exit code, so the forker never
+ * waits for a job and can let SIGCHLD reap the watchers.
+ */
+#define JOB_NO_TRACE -2		// exit code of a job whose tracefile cannot be read
 
-					default:
-						cerr << "Error, got invalid data from Trace" << endl;
-						exit(0);
-				}
+static unordered_map<string, LoadedTrace *> loaded_traces;	// forker only
+static int forker_fd = -1;
+static mutex forker_lock;
 
-				if(tr_data.type != TraceFile::ENTRY_TYPE_NOP)
-				{
-					Port_MemAddr.write(tr_data.addr);
+static mutex slot_lock;
+static condition_variable slot_free;
+static int slots_used = 0;
 
-					Port_MemFunc.write(f);
-					if (f == Cache::FUNC_WRITE) 
-					{
-						cout << sc_time_stamp() << ": CPU "<<cpu_id<<" sends write" << endl;
+static atomic<long> next_job(0);
 
-						uint32_t data = rand();
-						Port_MemData.write(data);
-						wait(); //this waiting for 1 cycle is mapping to the one cycle wait in the cache write hit.
-						Port_MemData.write("ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ");
-					}
-					else
-					{
-						cout << sc_time_stamp() << ": CPU  "<<cpu_id<<"sends read" << endl;
-					}
-					//cout <<"CPU: "<<"waiting for cache response" <<endl;
-					wait(Port_MemDone.value_changed_event());
-					//cout <<"CPU: "<<"get cache response" <<endl;
+/* One client, closed once its reader and all its jobs are done */
+struct Connection
+{
+	int fd;
+	mutex write_lock;
 
-					if (f == Cache::FUNC_READ)
-					{
-						cout << sc_time_stamp() << ": CPU reads: " << Port_MemData.read() << endl;
-					}
-				}
-				else
-				{
-					cout << sc_time_stamp() << ": CPU executes NOP" << endl;
-				}
-				// Advance one cycle in simulated time            
-				wait();
-			}
+	Connection(int fd) : fd(fd) {}
+	~Connection() { close(fd); }
 
-			// Finished the Tracefile, now stop the simulation
-			sc_stop();
+	void send_line(const string &line)
+	{
+		lock_guard<mutex> guard(write_lock);
+		string l = line + "\n";
+		for (size_t off = 0; off < l.size(); )
+		{
+			ssize_t n = send(fd, l.data() + off, l.size() - off, MSG_NOSIGNAL);
+			if (n <= 0)
+				return;
+			off += n;
 		}
+	}
 };
 
-
-int sc_main(int argc, char* argv[])
+static string json_escape(const string &s)
 {
-	try
+	string out;
+	for (size_t i = 0; i < s.size(); i++)
 	{
-		// Get the tracefile argument and create Tracefile object
-		// This function sets tracefile_ptr and num_cpus
-		init_tracefile(&argc, &argv);
-
-		// Initialize statistics counters
-		stats_init();
-#if 0
-		// Instantiate Modules
-		Cache mem("main_memory");
-		CPU    cpu("cpu");
-
-		// Signals
-		sc_buffer<Cache::Function> sigMemFunc;
-		sc_buffer<Cache::RetCode>  sigMemDone;
-		sc_signal<int>              sigMemAddr;
-		sc_signal_rv<32>            sigMemData;
-		sc_signal<bool> 	sigMemHit;
-		sc_signal<bool>              sigMemWr_Done;
-		sc_signal<bool>              sigMemWr_Func;
-		sc_signal<int>              sigMemHitLine;
-		sc_signal<int>              sigMemReplaceLine;
-		// The clock that will drive the CPU and Cache
-		sc_clock clk;
-
-		// Connecting module ports with signals
-		mem.Port_Func(sigMemFunc);
-		mem.Port_Addr(sigMemAddr);
-		mem.Port_Data(sigMemData);
-		mem.Port_Done(sigMemDone);
-		mem.Port_Hit(sigMemHit);
-		mem.Port_Wr_Done(sigMemWr_Done);
-		mem.Port_Wr_Func(sigMemWr_Func);
-		mem.Port_Hit_Line(sigMemHitLine);
-		mem.Port_Replace_Line(sigMemReplaceLine);
-
-		cpu.Port_MemFunc(sigMemFunc);
-		cpu.Port_MemAddr(sigMemAddr);
-		cpu.Port_MemData(sigMemData);
-		cpu.Port_MemDone(sigMemDone);
-
-		mem.Port_CLK(clk);
-		cpu.Port_CLK(clk);
-#endif
-
-
-		int snooping = 1;
-
-		Bus bus("bus");
-
-		sc_clock clk;
-		//sc_signal<int>            sigBusWriter;
-		//sc_buffer<Cache::BUS_REQ> sigBusReq;
-		//sc_signal_rv<32>          sigBusAddr;
-
-		//bus.Port_BusAddr(sigBusAddr);	
-		//bus.Port_BusWriter(sigBusWriter);
-		//bus.Port_BusReq(sigBusReq);
-		bus.Port_CLK(clk);
+		char c = s[i];
+		if (c == '"' || c == '\\')
+			out += '\\';
+		if ((unsigned char)c < 0x20)
+			out += ' ';
+		else
+			out += c;
+	}
+	return out;
+}
 
-		
-		//sigBusAddr.write("ZZZZZZZZZZZZZZZZZZZZZ");
-		//sigBusReq.write(Cache::BUS_INVALID);
+/* The tracefile read into memory, from the cache of loaded traces if it is there */
+static LoadedTrace *server_trace(const string &path)
+{
+	unordered_map<string, LoadedTrace *>::iterator it = loaded_traces.find(path);
+	if (it != loaded_traces.end())
+		return it->second;
+
+	FILE *f = fopen(path.c_str(), "r");
+	if (f == NULL)
+		return NULL;
+	fclose(f);
+
+	// init_tracefile takes the tracefile as the only argument
+	char prog[] = "cache_task2";
+	char *args[3] = { prog, (char *)path.c_str(), NULL };
+	int argc = 2;
+	char **argv = args;
+	init_tracefile(&argc, &argv);
+
+	vector<TraceRecord> records;
+	TraceSource *source = trace_source;
+	trace_source = new FileTraceSource;
+	load_trace(records);
+	delete trace_source;
+	trace_source = source;
+
+	LoadedTrace *trace = new LoadedTrace;
+	trace->streams.resize(num_cpus);
+	for (size_t k = 0; k < records.size(); k++)
+		trace->streams[records[k].cpu].push_back(records[k].entry);
+	loaded_traces[path] = trace;
+	return trace;
+}
 
-		sc_buffer<Cache::Function>  sigMemFunc[num_cpus];
-		sc_signal<int>              sigMemAddr[num_cpus];
-		sc_signal_rv<32>            sigMemData[num_cpus];
-		sc_buffer<Cache::RetCode>   sigMemDone[num_cpus];
-		sc_signal<bool> 	    sigMemHit[num_cpus];
+/* Body of the forked child: run one job in dir, exit with its status */
+static void run_job(vector<string> args, const LoadedTrace *trace, const string &dir)
+{
+	int status = 1;
 
-		Cache *cache[num_cpus];
-		CPU   *cpu[num_cpus];
+	mkdir(dir.c_str(), 0777);
+	if (freopen("/dev/null", "w", stdout) == NULL
+		|| freopen((dir + "/stderr.txt").c_str(), "w", stderr) == NULL)
+		_exit(1);
 
-		for(unsigned int i = 0; i < num_cpus; i++)
+	try
+	{
+		vector<char *> argv;
+		char prog[] = "cache_task2";
+		argv.push_back(prog);
+		for (size_t i = 0; i < args.size(); i++)
+			argv.push_back((char *)args[i].c_str());
+		argv.push_back(NULL);
+		int argc = argv.size() - 1;
+		char **argp = &argv[0];
+
+		// before the chdir: files named in the options, like --cache-config,
+		// are relative to the server as on the command line
+		parse_options(&argc, &argp);
+		opt_server = NULL;
+		if (chdir(dir.c_str()) != 0)
+			_exit(1);
+		chrono::steady_clock::time_point host_start = chrono::steady_clock::now();
+		LockSource *lock_source = select_source(&argc, &argp, trace);
+		status = simulate(host_start, lock_source);
+		double wall = chrono::duration<double>(chrono::steady_clock::now() - host_start).count();
+
+		FILE *f = fopen("result.json", "w");
+		if (f != NULL)
 		{
-			char name_cache[12];
-			char name_cpu[12];
-
-			sprintf(name_cache, "cache_%d", i);
-			sprintf(name_cpu, "cpu_%d", i);
-
-			/* Create objects for Cache and CPU */	
-			cache[i] = new Cache(name_cache);
-			cpu[i] = new CPU(name_cpu);
-
-			/* Set IDs */
-			cpu[i]->cpu_id = i;
-			cache[i]->cache_id = i;
-			cache[i]->snooping = snooping;
-
-			/* Connect Cache to Bus */
-			cache[i]->Port_BusAddr(bus.Port_BusAddr);	
-			cache[i]->Port_BusWriter(bus.Port_BusWriter);	
-			cache[i]->Port_BusReq(bus.Port_BusReq);	
-			cache[i]->Port_Bus(bus);
+			long total = report_reads + report_writes;
+			fprintf(f, "{\"cpus\":%u,\"waits\":%ld,\"reads\":%ld,\"writes\":%ld,\"wait_per_access\":%f,"
+				"\"exec_time\":\"%s\",\"accesses\":%ld,\"wall_s\":%.6f}",
+				num_cpus, report_waits, report_reads, report_writes,
+				total ? (double)report_waits / total : 0.0, json_escape(report_exec_time).c_str(),
+				sim_accesses, wall);
+			fclose(f);
+		}
+	}
+	catch (exception& e)
+	{
+		cerr << e.what() << endl;
+	}
+	fflush(NULL);
+	_exit(status);
+}
 
-			/* Connect Cache to CPU */
-			cache[i]->Port_Func(sigMemFunc[i]);	
-			cache[i]->Port_Addr(sigMemAddr[i]);	
-			cache[i]->Port_Data(sigMemData[i]);	
-			cache[i]->Port_Done(sigMemDone[i]);	
-			cache[i]->Port_Hit(sigMemHit[i]);
+/* The words of a job line, the tracefile in path. Returns whether it is a synthetic workload */
+static bool job_args(const string &line, vector<string> &args, string &path)
+{
+	istringstream words(line);
+	string word;
+	bool synth = false;
+	while (words >> word)
+	{
+		args.push_back(word);
+		if (word.compare(0, 8, "--synth=") == 0)
+			synth = true;
+		else if (word.compare(0, 2, "--") != 0)
+			path = word;
+	}
+	return synth;
+}
 
-			/* Connect CPU to Cache */
-			cpu[i]->Port_MemFunc(sigMemFunc[i]);	
-			cpu[i]->Port_MemAddr(sigMemAddr[i]);	
-			cpu[i]->Port_MemData(sigMemData[i]);	
-			cpu[i]->Port_MemDone(sigMemDone[i]);	
+/* Main loop of the forker: fork every job received on fd, exit when the server is gone */
+static void run_forker(int fd)
+{
+	signal(SIGCHLD, SIG_IGN);
+	while (true)
+	{
+		char buf[8192];
+		char control[CMSG_SPACE(sizeof(int))];
+		struct iovec iov = { buf, sizeof(buf) - 1 };
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		ssize_t n = recvmsg(fd, &msg, 0);
+		if (n <= 0)
+			_exit(0);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		int job_fd;
+		memcpy(&job_fd, CMSG_DATA(cmsg), sizeof(int));
+
+		// the message is the job's directory, a newline and the job line
+		buf[n] = '\0';
+		char *line = strchr(buf, '\n');
+		if (line == NULL)
+		{
+			close(job_fd);
+			continue;
+		}
+		*line++ = '\0';
+		string dir(buf);
+		vector<string> args;
+		string path;
+		bool synth = job_args(line, args, path);
+
+		LoadedTrace *trace = NULL;
+		int code = -1;
+		if (!synth && (path.empty() || (trace = server_trace(path)) == NULL))
+		{
+			code = JOB_NO_TRACE;
+			if (write(job_fd, &code, sizeof(code)) < 0)
+				perror("forker");
+			close(job_fd);
+			continue;
+		}
 
-			/* Connect clocks */
-			cache[i]->Port_CLK(clk);
-			cpu[i]->Port_CLK(clk);
+		fflush(NULL);
+		if (fork() == 0)
+		{
+			signal(SIGCHLD, SIG_DFL);
+			close(fd);
+			pid_t pid = fork();
+			if (pid == 0)
+			{
+				close(job_fd);
+				run_job(args, trace, dir);
+			}
+			int status;
+			if (pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status))
+				code = WEXITSTATUS(status);
+			_exit(write(job_fd, &code, sizeof(code)) == sizeof(code) ? 0 : 1);
 		}
+		// if the fork failed, the job's socket closes without an exit code
+		close(job_fd);
+	}
+}
 
+/* One job line: wait for a slot, have the forker run it, answer with the result */
+static void server_job(shared_ptr<Connection> conn, string line)
+{
+	long id = next_job++;
+	char dir[512];
+	snprintf(dir, sizeof(dir), "%s/job-%ld", opt_server_dir, id);
 
+	vector<string> args;
+	string path;
+	job_args(line, args, path);
 
-		cout << "Running (press CTRL+C to interrupt)... " << endl;
+	{
+		unique_lock<mutex> guard(slot_lock);
+		while (slots_used == opt_server_jobs)
+			slot_free.wait(guard);
+		slots_used++;
+	}
 
-		sc_trace_file *wf = sc_create_vcd_trace_file("CPU_MEM");
-		// Dump the desired signals
-		sc_trace(wf, clk, "clock");
-		//sc_trace(wf, sigMemFunc, "wr");//does not showup
-		//sc_trace(wf, sigMemDone, "ret");//does not showup
-		for(unsigned int i=0; i<num_cpus; i++)
+	// the exit code stays -1 if the forker or the watcher is gone
+	int code = -1;
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0)
+	{
+		string request = string(dir) + "\n" + line;
+		char control[CMSG_SPACE(sizeof(int))];
+		struct iovec iov = { (void *)request.data(), request.size() };
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		memset(control, 0, sizeof(control));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &sv[1], sizeof(int));
+
+		ssize_t sent;
 		{
-			char addr_cpu[16];
-			char data_cpu[16];
-			char hit_cache[16];
-
-			sprintf(addr_cpu, "cpu_addr_%d", i);
-			sprintf(data_cpu, "cpu_data_%d", i);
-			sprintf(hit_cache, "cache_hit_%d", i);
-
-			sc_trace(wf, sigMemAddr[i], addr_cpu);
-			sc_trace(wf, sigMemData[i], data_cpu);
-			sc_trace(wf, sigMemHit[i], hit_cache);
+			lock_guard<mutex> guard(forker_lock);
+			sent = sendmsg(forker_fd, &msg, MSG_NOSIGNAL);
 		}
-		sc_trace(wf, bus.Port_BusAddr , "addr_on_bus");
-		sc_trace(wf, bus.Port_BusWriter, "writer_on_bus");
-		sc_trace(wf, bus.Port_BusReq, "req_on_bus");
-
-
-		//sc_trace(wf, sigMemWr_Done, "wr_done");
-		//sc_trace(wf, sigMemWr_Func, "wr_func"); //function issued by cpu
-		//sc_trace(wf, sigMemHit, "Hit");
-		//sc_trace(wf, sigMemHitLine, "Hit_line");// show which set of cache line is hit
-		//sc_trace(wf, sigMemReplaceLine, "replace_line"); //show which set of cache line is replaced
-
+		close(sv[1]);
+		if (sent != (ssize_t)request.size() || recv(sv[0], &code, sizeof(code), MSG_WAITALL) != sizeof(code))
+			code = -1;
+		close(sv[0]);
+	}
+	{
+		lock_guard<mutex> guard(slot_lock);
+		slots_used--;
+	}
+	slot_free.notify_one();
 
-		// Start Simulation
-		//sc_start(42500,SC_NS);
-		char buffer[4096];
-		sc_start();
+	ostringstream answer;
+	answer << "{\"job\":" << id;
+	if (code == JOB_NO_TRACE)
+	{
+		answer << ",\"status\":\"error\",\"error\":\"cannot read tracefile " << json_escape(path) << "\"}";
+		conn->send_line(answer.str());
+		return;
+	}
 
+	string result;
+	ifstream in((string(dir) + "/result.json").c_str());
+	getline(in, result);
+	answer << ",\"status\":\"" << (code == 0 && !result.empty() ? "ok" : "failed") << "\""
+		<< ",\"exit\":" << code << ",\"dir\":\"" << json_escape(dir) << "\"";
+	if (!result.empty())
+		answer << ",\"result\":" << result;
+	answer << "}";
+	conn->send_line(answer.str());
+}
 
-		// Print statistics after simulation finished
-		stats_print(buffer);
-		cout<<endl;
-		strcat(buffer,"CPU\tProbeReads\tProbeWrites\n");
-		//printf(buffer,"CPU\tProbeReads\tProbeWrites\n");
-			char temp[1024];
-		for(unsigned int i =0; i < num_cpus; i++)
-		{
-		
-			sprintf(temp,"%d\t%d\t%d\n", i, ProbeReads,ProbeWrites);
-			strcat(buffer,temp);
-		}
-		cout<<endl;
-		strcat(buffer,"waits\treads\twrites\ttotal_access(r+w)\twait_per_access\n");
+/* Read the job lines of one client, each job in its own thread */
+static void server_connection(int fd)
+{
+	shared_ptr<Connection> conn(new Connection(fd));
+	FILE *in = fdopen(dup(fd), "r");
+	char buf[4096];
 
-		//printf("waits\treads\ttotal_access(r+w)\twait_per_access\n");
-		long total_accesses = bus.reads+bus.writes;
-		memset(temp,0,sizeof(temp));
+	while (in != NULL && fgets(buf, sizeof(buf), in) != NULL)
+	{
+		string line(buf);
+		if (line.find_first_not_of(" \t\r\n") == string::npos)
+			continue;
+		thread(server_job, conn, line).detach();
+	}
+	if (in != NULL)
+		fclose(in);
+}
 
-		sprintf(temp,"%ld\t%ld\t%ld\t%ld\t%f\n",bus.waits, bus.reads, bus.writes, total_accesses,(double)((float)bus.waits/(float)total_accesses));
+static int run_server()
+{
+	// the forker, before any thread exists
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) != 0)
+	{
+		perror("socketpair");
+		return 1;
+	}
+	fflush(NULL);
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		perror("fork");
+		return 1;
+	}
+	if (pid == 0)
+	{
+		close(sv[0]);
+		run_forker(sv[1]);
+	}
+	close(sv[1]);
+	forker_fd = sv[0];
+
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, opt_server, sizeof(addr.sun_path) - 1);
+	unlink(opt_server);
+	mkdir(opt_server_dir, 0777);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0)
+	{
+		perror(opt_server);
+		return 1;
+	}
+	cerr << "Serving on " << opt_server << ", " << opt_server_jobs << " jobs at once" << endl;
 
-		strcat(buffer,temp);
-		//memset(local,0,sizeof(local));
-		//char tmp[36]sc_time_stamp();
-		//sprintf(local,"Execution time = %s", sc_time_stamp());
-		//strcat(buffer,local);
-		printf("%s",buffer);
-#if 1
-		FILE * pFile;
-		pFile = fopen ("myfile.txt","w");
-		if (pFile!=NULL)
-		{
-			fputs(buffer, pFile);
-			//fputs ("fopen example",pFile);
-			fclose (pFile);
-		}
-//		fwrite (buffer , sizeof(char), sizeof(buffer), pFile);
-//		fclose (pFile);
-		
-		ofstream myfile;
-		myfile.open ("exec.txt");
-		myfile << sc_time_stamp();
-		myfile.close();
-#endif
+	while (true)
+	{
+		int client = accept(fd, NULL, NULL);
+		if (client < 0)
+			continue;
+		thread(server_connection, client).detach();
+	}
+	return 0;
+}
 
+int sc_main(int argc, char* argv[])
+{
+	try
+	{
+		// Strip our own options, then get the tracefile argument and create
+		// Tracefile object. This function sets tracefile_ptr and num_cpus
+		parse_options(&argc, &argv);
+		if (opt_server)
+			return run_server();
+		chrono::steady_clock::time_point host_start = chrono::steady_clock::now();
+		LockSource *lock_source = select_source(&argc, &argv, NULL);
+		return simulate(host_start, lock_source);
 	}
 	catch (exception& e)
 	{